@@ -0,0 +1,56 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include<vector>
+#include<algorithm>
+
+// Discrete distribution over [0,n) with O(1) sampling: Walker's alias method, built with Vose's
+// method. Every bin keeps its own index with probability q and otherwise hands over to its alias.
+class alias_table{
+  public:
+	alias_table(){}
+	alias_table(const std::vector<double>& weights){
+		int n=weights.size();
+		double total=0;
+		for(double w:weights)total+=std::max(w,0.);
+		bins.resize(n);
+		if(!n)return;
+		std::vector<double> scaled(n);
+		std::vector<int> small,large;
+		for(int i=0;i<n;i++){
+			bins[i].p=total>0?std::max(weights[i],0.)/total:1./n;
+			scaled[i]=bins[i].p*n;
+			(scaled[i]<1?small:large).push_back(i);
+		}
+		while(!small.empty()&&!large.empty()){
+			int s=small.back(),l=large.back();
+			small.pop_back();
+			bins[s].q=scaled[s],bins[s].alias=l;
+			scaled[l]-=1-scaled[s];
+			if(scaled[l]<1)large.pop_back(),small.push_back(l);
+		}
+		//what is left is 1 up to rounding
+		for(int i:small)bins[i].q=1,bins[i].alias=i;
+		for(int i:large)bins[i].q=1,bins[i].alias=i;
+	}
+
+	int size()const{ return bins.size();}
+	bool empty()const{ return bins.empty();}
+	double probability(int i)const{ return bins[i].p;}
+	// Index for u in [0,1).
+	int sample(double u)const{
+		int n=bins.size();
+		double x=u*n;
+		int i=std::min(int(x),n-1);
+		return x-i<bins[i].q?i:bins[i].alias;
+	}
+
+  private:
+	struct bin{
+		double q=1,p=0;
+		int alias=0;
+	};
+	std::vector<bin> bins;
+};
+
+#endif
@@ -22,7 +22,7 @@ class bounding_box{
         pad();
     }
 
-    double area(){return std::max(2*(x.size()*(y.size()+z.size())+y.size()*z.size()),0.);}
+    double area()const{return std::max(2*(x.size()*(y.size()+z.size())+y.size()*z.size()),0.);}
 
     bounding_box translate(const vec3& v){
         return bounding_box(x.translate(v.x()), y.translate(v.y()), z.translate(v.z()));
@@ -45,9 +45,13 @@ class bounding_box{
     }
 
     bool hit(const ray& r, const interval& ray_t)const{
+        double t_entry;
+        return hit(r,ray_t,t_entry);
+    }
+    bool hit(const ray& r, const interval& ray_t, double& t_entry)const{
         interval rx=intersect_x(r),ry=intersect_y(r),rz=intersect_z(r);
-        return std::max(std::max(ray_t.min,rx.min), std::max(ry.min,rz.min))
-              <std::min(std::min(ray_t.max,rx.max), std::min(ry.max,rz.max));
+        t_entry=std::max(std::max(ray_t.min,rx.min), std::max(ry.min,rz.min));
+        return t_entry<std::min(std::min(ray_t.max,rx.max), std::min(ry.max,rz.max));
     }
     static const bounding_box empty, universe;
   private:
@@ -4,79 +4,595 @@
 #include "common.h"
 #include "bounding_box.h"
 #include "hittable_list.h"
+#include "thread_pool.h"
 
+#include<vector>
 #include<algorithm>
+#include<chrono>
+#include<cmath>
 
-class bvh_node: public hittable{
+#if defined(__SSE2__)||defined(_M_X64)||(defined(_M_IX86_FP)&&_M_IX86_FP>=2)
+#define BVH_SSE
+#include<emmintrin.h>
+#endif
+
+// A ray prepared for box tests against float bounds. Direction components too close to zero
+// are nudged away from it so the slab test never computes 0*inf.
+class wide_ray{
   public:
-    bvh_node(hittable_list list): bvh_node(list.objects, 0, list.objects.size()){}
-    bvh_node(std::vector<std::shared_ptr<hittable> >& objects, int start, int end){
-        boundingbox=bounding_box::empty;
-        for(int i=start;i<end;i++)
-            boundingbox=bounding_box(boundingbox,objects[i]->bbox());
-        int division_dim=argmax(boundingbox.x.size(),boundingbox.y.size(),boundingbox.z.size());
-        auto box_cmp=(division_dim==0?box_cmp_x:(division_dim==1?box_cmp_y:box_cmp_z));
+    float o[3],inv_dir[3];
+    wide_ray(){}
+    wide_ray(const ray& r){
+        for(int a=0;a<3;a++){
+            double d=r.direction()[a];
+            if(std::abs(d)<1e-20)d=d<0?-1e-20:1e-20;
+            o[a]=r.origin()[a],inv_dir[a]=1/d;
+        }
+    }
+};
+
+// Conservative bounds over all rays of a packet for interval-arithmetic culling. They are only
+// valid when every ray has the same direction sign on each axis, as camera rays of one pixel do.
+class wide_packet_bounds{
+  public:
+    bool coherent;
+    bool dir_neg[3];
+    float o_lo[3],o_hi[3],inv_lo[3],inv_hi[3];
+    wide_packet_bounds(const wide_ray* rays, int active){
+        coherent=1;
+        int first=0;
+        while(!(active>>first&1))first++;
+        for(int a=0;a<3;a++){
+            dir_neg[a]=rays[first].inv_dir[a]<0;
+            o_lo[a]=o_hi[a]=rays[first].o[a],inv_lo[a]=inv_hi[a]=rays[first].inv_dir[a];
+        }
+        for(int i=first+1;i<ray_packet::max_size;i++){
+            if(!(active>>i&1))continue;
+            for(int a=0;a<3;a++){
+                if((rays[i].inv_dir[a]<0)!=dir_neg[a])coherent=0;
+                o_lo[a]=std::min(o_lo[a],rays[i].o[a]),o_hi[a]=std::max(o_hi[a],rays[i].o[a]);
+                inv_lo[a]=std::min(inv_lo[a],rays[i].inv_dir[a]),inv_hi[a]=std::max(inv_hi[a],rays[i].inv_dir[a]);
+            }
+        }
+    }
+};
+
+// Four children of a collapsed BVH node with their bounds stored SoA, so one ray is tested
+// against all of them at once. Bounds are rounded outwards to float. Children with count==0 are
+// inner wide nodes, the others are leaves covering count primitives from offset. Unused slots
+// have offset -1 and bounds at +inf, which a ray with an infinite range can still meet, so the
+// hit masks are cut down to the slots in use.
+struct alignas(16) wide_node{
+    float lo[3][4],hi[3][4];
+    int offset[4];
+    unsigned short count[4];
+    unsigned char used;//bit i set when child i exists
+
+    // Returns a bit mask of the children hit within ray_t and writes their entry distances.
+    int hit(const wide_ray& r, const interval& ray_t, float t_near[4])const{
+        const float shrink=1-1e-6f,grow=1+1e-6f;
+        float t_min=ray_t.min,t_max=ray_t.max;
+#ifdef BVH_SSE
+        __m128 near_t=_mm_set1_ps(t_min),far_t=_mm_set1_ps(t_max);
+        for(int a=0;a<3;a++){
+            __m128 o=_mm_set1_ps(r.o[a]),inv=_mm_set1_ps(r.inv_dir[a]);
+            __m128 t0=_mm_mul_ps(_mm_sub_ps(_mm_load_ps(lo[a]),o),inv);
+            __m128 t1=_mm_mul_ps(_mm_sub_ps(_mm_load_ps(hi[a]),o),inv);
+            near_t=_mm_max_ps(near_t,_mm_min_ps(t0,t1));
+            far_t=_mm_min_ps(far_t,_mm_max_ps(t0,t1));
+        }
+        near_t=_mm_mul_ps(near_t,_mm_set1_ps(shrink));
+        far_t=_mm_mul_ps(far_t,_mm_set1_ps(grow));
+        _mm_storeu_ps(t_near,near_t);
+        return _mm_movemask_ps(_mm_cmple_ps(near_t,far_t))&used;
+#else
+        int mask=0;
+        for(int i=0;i<4;i++){
+            float near_t=t_min,far_t=t_max;
+            for(int a=0;a<3;a++){
+                float t0=(lo[a][i]-r.o[a])*r.inv_dir[a],t1=(hi[a][i]-r.o[a])*r.inv_dir[a];
+                near_t=std::max(near_t,std::min(t0,t1));
+                far_t=std::min(far_t,std::max(t0,t1));
+            }
+            t_near[i]=near_t*shrink;
+            if(t_near[i]<=far_t*grow)mask|=1<<i;
+        }
+        return mask&used;
+#endif
+    }
+    // Mask of the children that at least one ray of the packet may hit within [t_min,t_max]:
+    // entry and exit distances are bounded over the whole range of origins and inverse
+    // directions of the packet, so a cleared bit means no ray of the packet hits that child.
+    int hit_interval(const wide_packet_bounds& b, float t_min, float t_max)const{
+        const float shrink=1-1e-6f,grow=1+1e-6f;
+        int mask=0;
+        for(int i=0;i<4;i++){
+            float near_t=t_min,far_t=t_max;
+            for(int a=0;a<3;a++){
+                float near_plane=b.dir_neg[a]?hi[a][i]:lo[a][i],far_plane=b.dir_neg[a]?lo[a][i]:hi[a][i];
+                float n0=(near_plane-b.o_hi[a])*b.inv_lo[a],n1=(near_plane-b.o_hi[a])*b.inv_hi[a];
+                float n2=(near_plane-b.o_lo[a])*b.inv_lo[a],n3=(near_plane-b.o_lo[a])*b.inv_hi[a];
+                float f0=(far_plane-b.o_hi[a])*b.inv_lo[a],f1=(far_plane-b.o_hi[a])*b.inv_hi[a];
+                float f2=(far_plane-b.o_lo[a])*b.inv_lo[a],f3=(far_plane-b.o_lo[a])*b.inv_hi[a];
+                near_t=std::max(near_t,std::min(std::min(n0,n1),std::min(n2,n3)));
+                far_t=std::min(far_t,std::max(std::max(f0,f1),std::max(f2,f3)));
+            }
+            if(near_t*shrink<=far_t*grow)mask|=1<<i;
+        }
+        return mask&used;
+    }
+};
+
+// A linear BVH over an indexed set of primitives. Nodes live in one array in depth-first order:
+// the first child of an inner node is the node right after it, the second one is at `offset`.
+// Leaves cover the primitives prim_order[offset..offset+count); owners are expected to store
+// their primitives in that order, so a leaf is a contiguous range of primitive indices.
+class bvh_tree{
+  public:
+    struct node{
+        bounding_box box;
+        int offset;
+        unsigned short count;//0 for inner nodes
+        unsigned char axis;
+    };
+    static const int max_depth=96;
+    static constexpr double traversal_cost=1,intersection_cost=1;
+
+    std::vector<node> nodes;
+    std::vector<wide_node> wide_nodes;
+    std::vector<int> prim_order;
+
+    enum build_method{binned_sah,sweep_sah};
+    static inline build_method default_method=binned_sah;
+    static inline bool report=false;//print build statistics to std::clog
+
+    void build(const std::vector<bounding_box>& boxes, build_method method=default_method){
+        auto start_time=std::chrono::steady_clock::now();
+        int n=boxes.size();
+        nodes.clear(),wide_nodes.clear(),prim_order.resize(n);
+        for(int i=0;i<n;i++)prim_order[i]=i;
+        if(n==0)return;
+        nodes.reserve(2*n);
+        if(method==sweep_sah)build_sweep(boxes,0,n,0);
+        else build_binned(boxes);
+        wide_nodes.reserve(nodes.size()/2+1);
+        collapse(0);
+        if(report){
+            double ms=std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-start_time).count();
+            std::clog<<"BVH ("<<(method==sweep_sah?"sweep":"binned")<<" SAH): "<<n<<" primitives, "
+                     <<nodes.size()<<" nodes ("<<wide_nodes.size()<<" 4-wide), SAH cost "<<sah_cost()
+                     <<", built in "<<ms<<" ms"<<std::endl;
+        }
+    }
+    // Expected cost of a random ray through the tree, with unit traversal and intersection costs.
+    double sah_cost()const{
+        if(nodes.empty())return 0;
+        double root_area=nodes[0].box.area(),cost=0;
+        for(auto& cur:nodes)cost+=cur.box.area()/root_area*(cur.count?cur.count*intersection_cost:traversal_cost);
+        return cost;
+    }
+    bool empty()const{ return nodes.empty();}
+    bounding_box bbox()const{ return nodes.empty()?bounding_box::empty:nodes[0].box;}
+
+    // Picks a primitive by walking down from the root with even odds at every inner node and
+    // uniformly inside the leaf it ends in.
+    int sample_primitive()const{
+        int id=0;
+        while(!nodes[id].count)id=random_int(2)==0?id+1:nodes[id].offset;
+        return nodes[id].offset+random_int(nodes[id].count);
+    }
+    // Density of the direction of r when a primitive is drawn by sample_primitive() and then
+    // sampled with density prim_pdf(i,r).
+    template<typename F>
+    double sample_pdf(const ray& r, F&& prim_pdf)const{ return sample_pdf(0,r,prim_pdf);}
+
+    // Closest-hit traversal over the 4-wide nodes. hit_primitive(i,r,ray_t,rec) tests primitive
+    // i and fills rec only when it finds a hit inside ray_t. The children hit by the ray are
+    // pushed far-to-near, so the nearest is visited first, and a pending child is dropped once
+    // its entry distance lies beyond the closest hit found so far.
+    template<typename F>
+    bool hit(const ray& r, interval ray_t, hit_record& rec, F&& hit_primitive)const{
+        if(wide_nodes.empty())return 0;
+        wide_ray wr(r);
+        int ref_stack[stack_size];unsigned short count_stack[stack_size];double entry_stack[stack_size];
+        int top=0;
+        ref_stack[top]=0,count_stack[top]=0,entry_stack[top++]=ray_t.min;
+        bool hit_anything=0;
+        while(top){
+            top--;
+            if(entry_stack[top]>ray_t.max)continue;
+            int ref=ref_stack[top];
+            if(count_stack[top]){
+                for(int i=ref;i<ref+count_stack[top];i++)
+                    if(hit_primitive(i,r,ray_t,rec))hit_anything=1,ray_t.max=rec.t;
+                continue;
+            }
+            const wide_node& cur=wide_nodes[ref];
+            float t_near[4];int order[4],k=0;
+            int mask=cur.hit(wr,ray_t,t_near);
+            for(int i=0;i<4;i++)
+                if(mask>>i&1){
+                    int j=k++;
+                    for(;j&&t_near[order[j-1]]<t_near[i];j--)order[j]=order[j-1];
+                    order[j]=i;
+                }
+            for(int j=0;j<k;j++){
+                int i=order[j];
+                ref_stack[top]=cur.offset[i],count_stack[top]=cur.count[i],entry_stack[top++]=t_near[i];
+            }
+        }
+        return hit_anything;
+    }
+
+    // Any-hit traversal: returns as soon as occludes(i,r,ray_t) reports a blocker, without
+    // ordering the children since any blocker will do.
+    template<typename F>
+    bool any_hit(const ray& r, const interval& ray_t, F&& occludes)const{
+        if(wide_nodes.empty())return 0;
+        wide_ray wr(r);
+        int ref_stack[stack_size];unsigned short count_stack[stack_size];
+        int top=0;
+        ref_stack[top]=0,count_stack[top++]=0;
+        while(top){
+            top--;
+            int ref=ref_stack[top];
+            if(count_stack[top]){
+                for(int i=ref;i<ref+count_stack[top];i++)
+                    if(occludes(i,r,ray_t))return 1;
+                continue;
+            }
+            const wide_node& cur=wide_nodes[ref];
+            float t_near[4];
+            int mask=cur.hit(wr,ray_t,t_near);
+            for(int i=0;i<4;i++)
+                if(mask>>i&1)ref_stack[top]=cur.offset[i],count_stack[top++]=cur.count[i];
+        }
+        return 0;
+    }
+
+    // Closest-hit traversal for the active rays of a packet. Each node is fetched once for the
+    // whole packet; when the packet is coherent a single interval-arithmetic test culls children
+    // that no ray can reach, and the remaining children are tested per ray to track which rays
+    // descend into them. hit_primitives(first,count,active,ray_t,rec) tests the primitives of a
+    // leaf against the active rays and returns the mask of rays whose closest hit it moved.
+    template<typename F>
+    int hit_packet(const ray_packet& packet, int active, interval ray_t[], hit_record rec[], F&& hit_primitives)const{
+        if(wide_nodes.empty()||!active)return 0;
+        wide_ray wr[ray_packet::max_size];
+        for(int i=0;i<packet.size;i++)wr[i]=wide_ray(packet.rays[i]);
+        wide_packet_bounds bounds(wr,active);
+        int ref_stack[stack_size],mask_stack[stack_size];unsigned short count_stack[stack_size];
+        int top=0,hit_mask=0;
+        ref_stack[top]=0,count_stack[top]=0,mask_stack[top++]=active;
+        while(top){
+            top--;
+            int ref=ref_stack[top],rays=mask_stack[top];
+            if(count_stack[top]){
+                hit_mask|=hit_primitives(ref,count_stack[top],rays,ray_t,rec);
+                continue;
+            }
+            const wide_node& cur=wide_nodes[ref];
+            int reachable=15;
+            if(bounds.coherent){
+                double t_min=infty,t_max=-infty;
+                for(int i=0;i<packet.size;i++)
+                    if(rays>>i&1)t_min=std::min(t_min,ray_t[i].min),t_max=std::max(t_max,ray_t[i].max);
+                reachable=cur.hit_interval(bounds,t_min,t_max);
+                if(!reachable)continue;
+            }
+            int child_rays[4]={0,0,0,0};float child_near[4]={INFINITY,INFINITY,INFINITY,INFINITY};
+            for(int i=0;i<packet.size;i++){
+                if(!(rays>>i&1))continue;
+                float t_near[4];
+                int mask=cur.hit(wr[i],ray_t[i],t_near)&reachable;
+                for(int c=0;c<4;c++)
+                    if(mask>>c&1)child_rays[c]|=1<<i,child_near[c]=std::min(child_near[c],t_near[c]);
+            }
+            int order[4],k=0;
+            for(int c=0;c<4;c++)
+                if(child_rays[c]){
+                    int j=k++;
+                    for(;j&&child_near[order[j-1]]<child_near[c];j--)order[j]=order[j-1];
+                    order[j]=c;
+                }
+            for(int j=0;j<k;j++){
+                int c=order[j];
+                ref_stack[top]=cur.offset[c],count_stack[top]=cur.count[c],mask_stack[top++]=child_rays[c];
+            }
+        }
+        return hit_mask;
+    }
+
+  private:
+    static const int num_bins=16,max_leaf_size=4;
+    static const int stack_size=3*max_depth+1;
+
+    template<typename F>
+    double sample_pdf(int id, const ray& r, F& prim_pdf)const{
+        const node& cur=nodes[id];
+        if(!cur.box.hit(r,interval(err,infty)))return 0;
+        if(!cur.count)return 0.5*(sample_pdf(id+1,r,prim_pdf)+sample_pdf(cur.offset,r,prim_pdf));
+        double accum=0;
+        for(int i=cur.offset;i<cur.offset+cur.count;i++)accum+=prim_pdf(i,r);
+        return accum/cur.count;
+    }
+
+    // Collapses the binary subtree rooted at node id into 4-wide nodes: the inner child with the
+    // largest surface area is opened until four children are gathered or only leaves remain.
+    int collapse(int id){
+        int w=wide_nodes.size();
+        wide_nodes.push_back(wide_node());
+        int children[4],num=0;
+        if(nodes[id].count)children[num++]=id;
+        else children[num++]=id+1,children[num++]=nodes[id].offset;
+        while(num<4){
+            int best=-1;
+            for(int i=0;i<num;i++)
+                if(!nodes[children[i]].count&&(best<0||nodes[children[i]].box.area()>nodes[children[best]].box.area()))
+                    best=i;
+            if(best<0)break;
+            int c=children[best];
+            children[best]=c+1,children[num++]=nodes[c].offset;
+        }
+        int offset[4];unsigned short count[4];
+        for(int i=0;i<4;i++){
+            if(i>=num){ offset[i]=-1,count[i]=0;continue;}
+            const node& child=nodes[children[i]];
+            count[i]=child.count;
+            offset[i]=child.count?child.offset:collapse(children[i]);
+        }
+        wide_node& cur=wide_nodes[w];
+        cur.used=(1<<num)-1;
+        for(int i=0;i<4;i++){
+            cur.offset[i]=offset[i],cur.count[i]=count[i];
+            if(i>=num){
+                for(int a=0;a<3;a++)cur.lo[a][i]=cur.hi[a][i]=INFINITY;
+                continue;
+            }
+            const bounding_box& b=nodes[children[i]].box;
+            const interval* axes[3]={&b.x,&b.y,&b.z};
+            for(int a=0;a<3;a++)cur.lo[a][i]=round_down(axes[a]->min),cur.hi[a][i]=round_up(axes[a]->max);
+        }
+        return w;
+    }
+    static float round_down(double x){
+        float f=x;
+        return f>x?std::nextafter(f,-INFINITY):f;
+    }
+    static float round_up(double x){
+        float f=x;
+        return f<x?std::nextafter(f,INFINITY):f;
+    }
+
+    int build_sweep(const std::vector<bounding_box>& boxes, int start, int end, int depth){
+        int id=nodes.size();
+        nodes.push_back(node());
+        bounding_box box=bounding_box::empty;
+        for(int i=start;i<end;i++)box=bounding_box(box,boxes[prim_order[i]]);
+        nodes[id].box=box;
         int num_objects=end-start;
-        if(num_objects==1)lson=objects[start],rson=nullptr;
-        else if(num_objects==2)lson=objects[start],rson=objects[start+1];
-        else{
-            std::sort(objects.begin()+start,objects.begin()+end,box_cmp);
-            double *prefix_surface_area = new double[num_objects];
-            double *suffix_surface_area = new double[num_objects];
+        if(num_objects<=2){
+            nodes[id].offset=start,nodes[id].count=num_objects,nodes[id].axis=0;
+            return id;
+        }
+        int division_dim=argmax(box.x.size(),box.y.size(),box.z.size());
+        std::sort(prim_order.begin()+start,prim_order.begin()+end,[&](int a,int b){
+            return centroid(boxes[a],division_dim)<centroid(boxes[b],division_dim);
+        });
+        int sep=num_objects/2;
+        if(depth<max_depth/2){//past that depth fall back to median splits to bound the stack
+            std::vector<double> suffix_surface_area(num_objects);
             bounding_box cur_bbox=bounding_box::empty;
-            for(int i=start;i<end;i++){
-                cur_bbox=bounding_box(cur_bbox,objects[i]->bbox());
-                prefix_surface_area[i-start]=cur_bbox.area();
-            }
-            cur_bbox=bounding_box::empty;
             for(int i=end-1;i>=start;i--){
-                cur_bbox=bounding_box(cur_bbox,objects[i]->bbox());
+                cur_bbox=bounding_box(cur_bbox,boxes[prim_order[i]]);
                 suffix_surface_area[i-start]=cur_bbox.area();
             }
-            int sep=num_objects/2;double cost=infty;
-            for(int i=1;i<num_objects-1;i++){
-                double new_cost=i*prefix_surface_area[i-1]+(num_objects-i)*suffix_surface_area[i];
+            cur_bbox=bounding_box::empty;
+            double cost=infty;
+            for(int i=1;i<num_objects;i++){
+                cur_bbox=bounding_box(cur_bbox,boxes[prim_order[start+i-1]]);
+                double new_cost=i*cur_bbox.area()+(num_objects-i)*suffix_surface_area[i];
                 if(new_cost<cost)cost=new_cost,sep=i;
             }
-            delete[] prefix_surface_area;
-            delete[] suffix_surface_area;
-            lson=std::make_shared<bvh_node>(objects,start,start+sep);
-            rson=std::make_shared<bvh_node>(objects,start+sep,end);
         }
+        build_sweep(boxes,start,start+sep,depth+1);
+        int second=build_sweep(boxes,start+sep,end,depth+1);
+        nodes[id].offset=second,nodes[id].count=0,nodes[id].axis=division_dim;
+        return id;
+    }
+
+    // Binned SAH over all three axes. The top of the tree is split serially until there are
+    // enough independent subtrees to keep the thread pool busy; those are built in parallel into
+    // their own node arrays and spliced back in depth-first order.
+    struct build_context{
+        const std::vector<bounding_box>& boxes;
+        std::vector<point3> centroids;
+    };
+    struct top_node{
+        bounding_box box;
+        int axis,left,right,task;//task>=0 marks a subtree that is built by a worker
+    };
+    struct build_task{
+        int start,end,depth;
+        std::vector<node> nodes;
+    };
+    struct split{
+        int axis,mid;
+        bounding_box box;
+        bool leaf;
+    };
+
+    void build_binned(const std::vector<bounding_box>& boxes){
+        build_context ctx{boxes,std::vector<point3>(boxes.size())};
+        for(int i=0;i<(int)boxes.size();i++)
+            ctx.centroids[i]=point3(boxes[i].x.midpoint(),boxes[i].y.midpoint(),boxes[i].z.midpoint());
+        thread_pool& pool=thread_pool::global();
+        int task_size=std::max<int>(1024,boxes.size()/(4*pool.size()));
+        std::vector<top_node> top;
+        std::vector<build_task> tasks;
+        split_top(ctx,0,boxes.size(),0,task_size,top,tasks);
+        pool.parallel_for(tasks.size(),[&](int t,int worker){
+            build_task& task=tasks[t];
+            build_binned(ctx,task.start,task.end,task.depth,task.nodes);
+        });
+        emit_top(top,tasks,0);
+    }
+    int split_top(const build_context& ctx, int start, int end, int depth, int task_size,
+                  std::vector<top_node>& top, std::vector<build_task>& tasks){
+        int id=top.size();
+        top.push_back(top_node{bounding_box::empty,0,-1,-1,-1});
+        if(end-start>task_size){
+            split s=find_split(ctx,start,end,depth);
+            if(!s.leaf){
+                top[id].box=s.box,top[id].axis=s.axis;
+                int left=split_top(ctx,start,s.mid,depth+1,task_size,top,tasks);
+                int right=split_top(ctx,s.mid,end,depth+1,task_size,top,tasks);
+                top[id].left=left,top[id].right=right;
+                return id;
+            }
+        }
+        top[id].task=tasks.size();
+        tasks.push_back(build_task{start,end,depth,std::vector<node>()});
+        return id;
+    }
+    void emit_top(const std::vector<top_node>& top, const std::vector<build_task>& tasks, int id){
+        if(top[id].task>=0){
+            int base=nodes.size();
+            for(node cur:tasks[top[id].task].nodes){
+                if(!cur.count)cur.offset+=base;
+                nodes.push_back(cur);
+            }
+            return;
+        }
+        int cur=nodes.size();
+        nodes.push_back(node{top[id].box,0,0,(unsigned char)top[id].axis});
+        emit_top(top,tasks,top[id].left);
+        nodes[cur].offset=nodes.size();
+        emit_top(top,tasks,top[id].right);
+    }
+    int build_binned(const build_context& ctx, int start, int end, int depth, std::vector<node>& out){
+        int id=out.size();
+        split s=find_split(ctx,start,end,depth);
+        out.push_back(node{s.box,start,(unsigned short)(end-start),(unsigned char)s.axis});
+        if(s.leaf)return id;
+        build_binned(ctx,start,s.mid,depth+1,out);
+        int second=build_binned(ctx,s.mid,end,depth+1,out);
+        out[id].offset=second,out[id].count=0;
+        return id;
+    }
+    // Finds the cheapest of the num_bins-1 candidate planes on each axis and partitions
+    // prim_order[start,end) accordingly, or decides that the range should stay a leaf.
+    split find_split(const build_context& ctx, int start, int end, int depth){
+        split s{0,start,bounding_box::empty,true};
+        point3 cmin(infty),cmax(-infty);
+        for(int i=start;i<end;i++){
+            int p=prim_order[i];
+            s.box=bounding_box(s.box,ctx.boxes[p]);
+            const point3& c=ctx.centroids[p];
+            cmin=point3(std::min(cmin.x(),c.x()),std::min(cmin.y(),c.y()),std::min(cmin.z(),c.z()));
+            cmax=max(cmax,c);
+        }
+        int n=end-start;
+        if(n<=2)return s;
+        vec3 extent=cmax-cmin;
+        int best_axis=-1,best_plane=0;
+        double best_cost=infty,node_area=s.box.area();
+        if(depth<max_depth/2)
+            for(int axis=0;axis<3;axis++){
+                if(extent[axis]<=0)continue;
+                bounding_box bin_box[num_bins];
+                int bin_count[num_bins]={0};
+                for(int i=start;i<end;i++){
+                    int p=prim_order[i],b=bin_of(ctx.centroids[p][axis],cmin[axis],extent[axis]);
+                    bin_box[b]=bounding_box(bin_box[b],ctx.boxes[p]);
+                    bin_count[b]++;
+                }
+                double suffix_area[num_bins];int suffix_count[num_bins];
+                bounding_box cur=bounding_box::empty;int count=0;
+                for(int b=num_bins-1;b>0;b--){
+                    cur=bounding_box(cur,bin_box[b]),count+=bin_count[b];
+                    suffix_area[b]=cur.area(),suffix_count[b]=count;
+                }
+                cur=bounding_box::empty,count=0;
+                for(int b=1;b<num_bins;b++){
+                    cur=bounding_box(cur,bin_box[b-1]),count+=bin_count[b-1];
+                    if(!count||!suffix_count[b])continue;
+                    double cost=traversal_cost+intersection_cost*(count*cur.area()+suffix_count[b]*suffix_area[b])/node_area;
+                    if(cost<best_cost)best_cost=cost,best_axis=axis,best_plane=b;
+                }
+            }
+        if(best_axis<0){//coincident centroids or too deep: split at the median of the widest axis
+            if(n<=max_leaf_size)return s;
+            s.axis=argmax(extent.x(),extent.y(),extent.z()),s.mid=start+n/2,s.leaf=false;
+            std::nth_element(prim_order.begin()+start,prim_order.begin()+s.mid,prim_order.begin()+end,[&](int a,int b){
+                return ctx.centroids[a][s.axis]<ctx.centroids[b][s.axis];
+            });
+            return s;
+        }
+        if(n<=max_leaf_size&&best_cost>=n*intersection_cost)return s;
+        s.axis=best_axis,s.leaf=false;
+        s.mid=std::partition(prim_order.begin()+start,prim_order.begin()+end,[&](int p){
+            return bin_of(ctx.centroids[p][best_axis],cmin[best_axis],extent[best_axis])<best_plane;
+        })-prim_order.begin();
+        return s;
+    }
+    static int bin_of(double c, double cmin, double extent){
+        return std::min(num_bins-1,int(num_bins*(c-cmin)/extent));
+    }
+    static double centroid(const bounding_box& b, int dim){
+        return dim==0?b.x.midpoint():(dim==1?b.y.midpoint():b.z.midpoint());
+    }
+};
+
+class bvh_node: public hittable{
+  public:
+    bvh_node(hittable_list list): bvh_node(list.objects, 0, list.objects.size()){}
+    bvh_node(std::vector<std::shared_ptr<hittable> >& objects, int start, int end){
+        std::vector<bounding_box> boxes;
+        for(int i=start;i<end;i++)boxes.push_back(objects[i]->bbox());
+        tree.build(boxes);
+        for(int i:tree.prim_order)primitives.push_back(objects[start+i]);
     }
     bool hit(const ray& r, const interval& ray_t, hit_record& rec)const override{
-        if(!boundingbox.hit(r,ray_t))return 0;
-        bool hit_l=0,hit_r=0;
-        if(lson!=nullptr)hit_l=lson->hit(r,ray_t,rec);
-        if(rson!=nullptr)hit_r=rson->hit(r,interval(ray_t.min,hit_l?rec.t:ray_t.max),rec);
-        return hit_l||hit_r;
+        return tree.hit(r,ray_t,rec,[this](int i,const ray& r,const interval& ray_t,hit_record& rec){
+            return primitives[i]->hit(r,ray_t,rec);
+        });
     }
-    bounding_box bbox()const override{ return boundingbox;}
-    double sample_pdf(const ray& r)const override{
-        if(!boundingbox.hit(r,interval(err,infty)))return 0;
-        if(lson==nullptr&&rson==nullptr)return 1/(4*pi);
-        if(rson==nullptr)return lson->sample_pdf(r);
-        if(lson==nullptr)return rson->sample_pdf(r);
-        return 0.5*(lson->sample_pdf(r)+rson->sample_pdf(r));
+    bool occluded(const ray& r, double t_max)const override{
+        occluder_cache& cache=last_occluder(occluder_id);
+        if(cache.owner==occluder_id&&primitives[cache.prim]->occluded(r,t_max))return 1;
+        return tree.any_hit(r,interval(err,t_max),[&](int i,const ray& r,const interval& ray_t){
+            if(!primitives[i]->occluded(r,t_max))return false;
+            cache.owner=occluder_id,cache.prim=i;
+            return true;
+        });
     }
-    vec3 sample(const point3& origin, const double time)const override{
-        if(lson==nullptr&&rson==nullptr)return random_unit_vector();
-        if(rson==nullptr)return lson->sample(origin,time);
-        if(lson==nullptr)return rson->sample(origin,time);
-        return (rand()%2==0?lson:rson)->sample(origin,time);
+    int hit_packet(const ray_packet& packet, int active, interval ray_t[], hit_record rec[])const override{
+        return tree.hit_packet(packet,active,ray_t,rec,[&](int first,int count,int active,interval ray_t[],hit_record rec[]){
+            int hit_mask=0;
+            for(int i=first;i<first+count;i++)hit_mask|=primitives[i]->hit_packet(packet,active,ray_t,rec);
+            return hit_mask;
+        });
     }
-  private:
-    std::shared_ptr<hittable> lson,rson;
-    bounding_box boundingbox;
-    static bool box_cmp_x(const std::shared_ptr<hittable>& a, const std::shared_ptr<hittable>& b){
-        return a->bbox().x.midpoint()<b->bbox().x.midpoint();
+    bounding_box bbox()const override{ return tree.bbox();}
+    double sample_pdf(const ray& r)const override{
+        if(tree.empty())return 1/(4*pi);
+        return tree.sample_pdf(r,[this](int i,const ray& r){ return primitives[i]->sample_pdf(r);});
     }
-    static bool box_cmp_y(const std::shared_ptr<hittable>& a, const std::shared_ptr<hittable>& b){
-        return a->bbox().y.midpoint()<b->bbox().y.midpoint();
+    vec3 sample(const point3& origin, const double time)const override{
+        if(tree.empty())return random_unit_vector();
+        return primitives[tree.sample_primitive()]->sample(origin,time);
     }
-    static bool box_cmp_z(const std::shared_ptr<hittable>& a, const std::shared_ptr<hittable>& b){
-        return a->bbox().z.midpoint()<b->bbox().z.midpoint();
+    light_bounds emission_bounds()const override{
+        if(primitives.empty())return light_bounds(bbox(),0);
+        light_bounds b=primitives[0]->emission_bounds();
+        for(size_t i=1;i<primitives.size();i++)b=light_bounds(b,primitives[i]->emission_bounds());
+        return b;
     }
+  private:
+    bvh_tree tree;
+    std::vector<std::shared_ptr<hittable> > primitives;
+    uint64_t occluder_id=new_occluder_id();
 };
 
-#endif
\ No newline at end of file
+#endif
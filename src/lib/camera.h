@@ -6,9 +6,19 @@
 #include "material.h"
 #include "pdf.h"
 #include "scatter_record.h"
+#include "thread_pool.h"
+#include "ray_packet.h"
+#include "sampler.h"
+#include "filter.h"
+#include "environment.h"
+#include "reservoir.h"
+#include "path_guide.h"
+#include "radiance_cache.h"
+#include "photon_map.h"
 
-#include<thread>
 #include<mutex>
+#include<vector>
+#include<algorithm>
 
 class camera{
   public:
@@ -24,6 +34,27 @@ class camera{
 	vec3 vup;
 	double focus_dist;
 	double defocus_angle;
+	int tile_size=16;
+	int packet_size=16;//camera rays traced together per pixel, at most ray_packet::max_size
+	int rr_depth=3;//bounces before Russian roulette may end a path
+	bool wavefront=false;//trace batches of paths stage by stage instead of one path at a time
+	int wavefront_size=1<<14;//paths per wavefront batch
+	shared_ptr<sampler> pixel_sampler=make_shared<stratified_sampler>();//cloned for every worker
+	shared_ptr<pixel_filter> filter=make_shared<box_filter>();//importance sampled by the camera rays
+	bool track_variance=false;//also estimate the variance of every pixel, into pixel_variance
+	std::vector<color> pixel_variance;//variance of each pixel's estimate, row by row, after render()
+	shared_ptr<environment_light> environment;//when set, replaces background and is sampled as a light
+	int light_candidates=0;//above 0, one shadow ray per vertex, to a light sample resampled out of this many
+	int reuse_neighbours=0;//wavefront with light_candidates: other pixels' primary reservoirs merged into each
+	int reuse_radius=10;//in pixels, for reuse_neighbours
+	int guide_passes=0;//training passes of 1,2,4,... samples per pixel that teach a path guide before the image
+	double guide_fraction=0.5;//share of BSDF samples the trained guide draws
+	bool cache_radiance=false;//end paths early on reflected radiance cached in a world-space hash grid
+	double cache_cell=8;//size of a cache cell, in pixel footprints at its distance from the camera
+	double cache_spread=0.01;//a path reads the cache once its footprint passes this share of the camera's
+	int caustic_photons=0;//photons from the lights and environment per pass into a caustic map diffuse surfaces gather
+	double photon_radius=0;//gather radius of the caustic map, 0 for 1/200 of the visible part of the scene
+	int photon_passes=1;//passes the samples are split into, each with fresh photons and a smaller radius
 
 	camera(int image_width=100, 
 		   double aspect_ratio=1.0, 
@@ -48,66 +79,226 @@ class camera{
 		focus_dist(focus_dist),
 		defocus_angle(defocus_angle){}
 
-	void render(const shared_ptr<hittable>& scene, const shared_ptr<hittable>& lights=make_shared<hittable_list>()){
+	void render(const shared_ptr<hittable>& scene, const shared_ptr<hittable>& scene_lights=make_shared<hittable_list>()){
 		init();
+		//the environment takes half of the light samples when there are other lights
+		shared_ptr<hittable> lights=scene_lights;
+		if(environment){
+			auto both=make_shared<hittable_list>();
+			if(!scene_lights->empty())both->add(scene_lights);
+			both->add(environment);
+			lights=both;
+		}
+		//with no lights, light samples cover the whole sphere and a target function has nothing to go by
+		resampling=light_candidates>0&&!lights->empty();
 		
 		std::cout<<"P3\n"<<image_width<<' '<<image_height <<"\n255\n";
 
-		int sqrt_spp=ceil(sqrt(samples_per_pixel));
-		int real_spp=sqrt_spp*sqrt_spp;
-		int num_thread=16;
-		std::thread *th = new std::thread[num_thread];
-		int scanlines_remaining=image_height;
-		std::mutex mtx;
 		color *pixel_colors = new color[image_width*image_height];
-
-		auto subprocess = [&](int r) -> void{
-			color *pixel_color_buffer = new color[real_spp];
-			for (int j=r;j<image_height;j+=num_thread){
-				mtx.lock();
-				std::clog<<"\rScanlines remaining: "<<scanlines_remaining<<' '<<std::flush;
-				scanlines_remaining--;
-				mtx.unlock();
-				for (int i=0;i<image_width;i++){
-					point3 pixel_upper_left=viewport_upper_left+j*pixel_delta_v+i*pixel_delta_u;
-					color pixel_color(0,0,0);
-					for(int si=0;si<sqrt_spp;si++)
-						for(int sj=0;sj<sqrt_spp;sj++){
-							point3 pixel_sample=pixel_upper_left+(si+random_double())/sqrt_spp*pixel_delta_u
-																+(sj+random_double())/sqrt_spp*pixel_delta_v;
-							point3 ray_origin=sample_in_defocus_disk();
-							double ray_time=random_double();
-							ray r(ray_origin,normalize(pixel_sample-ray_origin),ray_time);
-
-							color raycolor=ray_color(r,scene,lights,1./max_depth,max_depth);
-							if(raycolor.e0!=raycolor.e0)raycolor.e0=0;
-							if(raycolor.e1!=raycolor.e1)raycolor.e1=0;
-							if(raycolor.e2!=raycolor.e2)raycolor.e2=0;
-							pixel_color_buffer[si*sqrt_spp+sj]=raycolor;
-						}
-					pixel_colors[j*image_width+i]=anti_aliasing(pixel_color_buffer,sqrt_spp,sqrt_spp,
-																std::min(8,int(sqrt(sqrt_spp))));
-				}
+		cache.reset();
+		if(cache_radiance)cache=std::make_shared<radiance_cache>(center,length(pixel_delta_u)/focus_dist,cache_cell);
+		//training passes draw from sequences of their own, so the image is independent of what the
+		//guide learned from
+		guide.reset();
+		if(guide_passes>0){
+			guide=std::make_shared<path_guide>(scene->bbox());
+			uint64_t seed=random_seed();
+			guide_training=true;
+			for(int k=0;k<guide_passes;k++){
+				random_seed()=mix_bits(seed^(k+1));
+				render_pass(*scene,*lights,1<<k,pixel_colors);
+				guide->refine(k);
 			}
-			delete[] pixel_color_buffer;
-		};
+			guide_training=false;
+			random_seed()=seed;
+		}
+		if(caustic_photons>0)render_photon_passes(*scene,*scene_lights,*lights,std::max(1,samples_per_pixel),pixel_colors);
+		else render_pass(*scene,*lights,std::max(1,samples_per_pixel),pixel_colors);
 
-		for(int i=0;i<num_thread;i++)th[i]=std::thread(subprocess,i);
-		for(int i=0;i<num_thread;i++)th[i].join();
 		for(int i=0;i<image_height*image_width;i++)
 			write_color(std::cout,pixel_colors[i]);
 		delete[] pixel_colors;
-		delete[] th;
 		std::clog << "\rDone.                 \n";
 	}
   private:
 	int image_height;
 	point3 center;
-	point3 pixel00_loc,viewport_upper_left;
+	point3 pixel00_loc;
 	vec3 pixel_delta_u, pixel_delta_v;//u horizontal, v vertical
 	vec3 u,v,w;
 	vec3 defocus_u,defocus_v;
+	static const int light_samples=3;
+	bool resampling;
+	std::shared_ptr<path_guide> guide;
+	bool guide_training=false;//whether paths record into the guide
+	std::shared_ptr<radiance_cache> cache;
+	std::shared_ptr<photon_map> photons;//caustics of the current pass
+	const hittable* photon_sources=nullptr;//the lights the caustic map was traced from
 	
+	static unsigned morton_code(unsigned x, unsigned y){
+		unsigned code=0;
+		for(int b=0;b<16;b++)code|=((x>>b&1)<<(2*b))|((y>>b&1)<<(2*b+1));
+		return code;
+	}
+
+	// Renders the image at spp samples per pixel into pixel_colors. Guide training passes and the
+	// radiance cache trace one path at a time, since each path records its vertices when it ends.
+	void render_pass(const hittable& scene, const hittable& lights, int spp, color* pixel_colors){
+		int packet_width=std::max(1,std::min(packet_size,ray_packet::max_size));
+		int tiles_x=(image_width+tile_size-1)/tile_size,tiles_y=(image_height+tile_size-1)/tile_size;
+		std::vector<std::pair<int,int> > tiles;
+		for(int ty=0;ty<tiles_y;ty++)
+			for(int tx=0;tx<tiles_x;tx++)tiles.push_back(std::make_pair(tx,ty));
+		std::sort(tiles.begin(),tiles.end(),[](const std::pair<int,int>& a,const std::pair<int,int>& b){
+			return morton_code(a.first,a.second)<morton_code(b.first,b.second);
+		});
+
+		bool wavefront_pass=wavefront&&!guide_training&&!cache;
+		thread_pool& pool=thread_pool::global();
+		std::vector<std::vector<color> > tile_buffers(pool.size(),std::vector<color>(tile_size*tile_size));
+		std::vector<wavefront_batch> batches(wavefront_pass?pool.size():0);
+		std::vector<std::unique_ptr<sampler> > samplers;
+		for(int w=0;w<pool.size();w++)samplers.push_back(pixel_sampler->clone());
+		pixel_variance.assign(track_variance?image_width*image_height:0,color(0,0,0));
+		int tiles_remaining=tiles.size();
+		std::mutex mtx;
+
+		pool.parallel_for(tiles.size(),[&](int t,int worker){
+			color *tile_buffer=tile_buffers[worker].data();
+			int x0=tiles[t].first*tile_size,y0=tiles[t].second*tile_size;
+			int x1=std::min(x0+tile_size,image_width),y1=std::min(y0+tile_size,image_height);
+			sampler& smp=*samplers[worker];
+			active_sample_source()=&smp;
+			if(wavefront_pass)render_tile_wavefront(x0,y0,x1,y1,spp,scene,lights,smp,tile_buffer,batches[worker]);
+			else for (int j=y0;j<y1;j++)
+				for (int i=x0;i<x1;i++){
+					pixel_accumulator pixel;
+					for(int first=0;first<spp;first+=packet_width){
+						ray_packet packet;
+						sample_state states[ray_packet::max_size];
+						interval ray_t[ray_packet::max_size];
+						hit_record rec[ray_packet::max_size];
+						double weight[ray_packet::max_size];
+						for(int s=first;s<std::min(first+packet_width,spp);s++){
+							packet.add(camera_ray(i,j,s,spp,smp,weight[packet.size]));
+							states[packet.size-1]=save_sample(smp);
+							ray_t[packet.size-1]=interval(err,infty);
+						}
+						//primary hits of the whole packet first, then each path goes on by itself
+						int hit_mask=scene.hit_packet(packet,packet.all(),ray_t,rec);
+						for(int k=0;k<packet.size;k++){
+							resume_sample(smp,i,j,first+k,spp,states[k]);
+							if(hit_mask>>k&1)rec[k].obj->compute_surface_interaction(packet.rays[k],rec[k]);
+							path_state path(packet.rays[k]);
+							pixel.add(drop_nan(trace_path(path,hit_mask>>k&1,rec[k],scene,lights)),weight[k]);
+						}
+					}
+					tile_buffer[(j-y0)*tile_size+(i-x0)]=pixel.value();
+					if(track_variance)pixel_variance[j*image_width+i]=pixel.variance();
+				}
+			active_sample_source()=nullptr;
+			for (int j=y0;j<y1;j++)
+				std::copy(tile_buffer+(j-y0)*tile_size,tile_buffer+(j-y0)*tile_size+(x1-x0),
+						  pixel_colors+j*image_width+x0);
+			std::lock_guard<std::mutex> lock(mtx);
+			std::clog<<"\rTiles remaining: "<<--tiles_remaining<<' '<<std::flush;
+		});
+	}
+
+	// Renders spp samples per pixel in photon_passes passes, each with a caustic map of its own.
+	// The radius shrinks from pass to pass as in progressive photon mapping (Knaus and Zwicker,
+	// Progressive Photon Mapping: A Probabilistic Approach, 2011), r_{k+1}^2=r_k^2*(k+alpha)/(k+1),
+	// so the average of the passes loses the blur of the first ones as passes are added.
+	void render_photon_passes(const hittable& scene, const hittable& scene_lights, const hittable& lights, int spp,
+							  color* pixel_colors){
+		const double alpha=2./3;
+		bounding_box region=visible_region(scene);
+		double radius=photon_radius>0?photon_radius:length(vec3(region.x.size(),region.y.size(),region.z.size()))/200;
+		int passes=std::max(1,std::min(photon_passes,spp)),num_pixels=image_width*image_height;
+		std::vector<color> sum(num_pixels,color(0,0,0)),variance_sum(track_variance?num_pixels:0,color(0,0,0));
+		uint64_t seed=random_seed();
+		for(int k=0;k<passes;k++){
+			if(k)random_seed()=mix_bits(~seed^k);
+			int pass_spp=spp*(k+1)/passes-spp*k/passes;
+			photon_sources=&scene_lights;
+			photons=trace_photons(scene,scene_lights,environment.get(),region,radius);
+			render_pass(scene,lights,pass_spp,pixel_colors);
+			double weight=double(pass_spp)/spp;
+			for(int i=0;i<num_pixels;i++)sum[i]+=weight*pixel_colors[i];
+			for(int i=0;i<(int)variance_sum.size();i++)variance_sum[i]+=weight*weight*pixel_variance[i];
+			radius*=std::sqrt((k+1+alpha)/(k+2));
+		}
+		std::copy(sum.begin(),sum.end(),pixel_colors);
+		if(track_variance)pixel_variance=variance_sum;
+		photons.reset();
+		photon_sources=nullptr;
+		random_seed()=seed;
+	}
+	// Traces caustic_photons photons from the lights, and from the environment map when there is
+	// one (half of them each when there are both), and keeps those that reach a diffuse surface
+	// through one or more specular bounces and nothing else. Environment photons aim at region. A
+	// constant background casts no sharp caustics, so paths that see it through specular bounces
+	// keep it. Workers trace chunks of photons, each chunk on a sequence of its own.
+	std::shared_ptr<photon_map> trace_photons(const hittable& scene, const hittable& lights, const environment_light* sky,
+											  const bounding_box& region, double radius){
+		bool lit=!lights.empty();
+		int sources=lit+(sky!=nullptr);
+		const int chunk_size=1024;
+		int chunks=sources?(caustic_photons+chunk_size-1)/chunk_size:0;
+		std::vector<std::vector<photon_map::photon> > chunk_photons(chunks);
+		thread_pool::global().parallel_for(chunks,[&](int c,int worker){
+			seed_random(uint64_t(image_width)*image_height+c,0);
+			for(int i=c*chunk_size;i<std::min(caustic_photons,(c+1)*chunk_size);i++){
+				double time=random_double();
+				ray r;
+				color power;
+				bool from_sky=sky&&(!lit||random_double()<0.5);
+				if(from_sky?sky->sample_photon(region,time,r,power):lights.sample_photon(time,r,power))
+					trace_photon(scene,r,power*(double(sources)/caustic_photons),chunk_photons[c]);
+			}
+		});
+		std::vector<photon_map::photon> stored;
+		for(auto& p:chunk_photons)stored.insert(stored.end(),p.begin(),p.end());
+		return std::make_shared<photon_map>(stored,radius);
+	}
+	void trace_photon(const hittable& scene, ray r, color power, std::vector<photon_map::photon>& stored)const{
+		bool specular=false;
+		hit_record rec;
+		for(int depth=0;depth<max_depth&&scene.hit_surface(r,interval(err,infty),rec);depth++){
+			scatter_record scatter;
+			if(!rec.mat->scatter(r,rec,scatter))return;
+			if(scatter.using_importance_sampling){
+				if(specular)stored.push_back(photon_map::photon{rec.p,normalize(r.direction()),make_safe(power)});
+				return;
+			}
+			power*=scatter.attenuation(scatter.sample_ray.direction());
+			if(power<=0)return;
+			specular|=!scatter.path_unchanged;
+			r=scatter.sample_ray;
+		}
+	}
+	// Box around what a coarse grid of camera rays sees, grown by half its size on every side and
+	// kept inside the scene: where the caustics that matter to the image land.
+	bounding_box visible_region(const hittable& scene){
+		const int n=32;
+		bounding_box seen;
+		for(int j=0;j<n;j++)
+			for(int i=0;i<n;i++){
+				point3 target=pixel00_loc+(i+.5)*image_width/n*pixel_delta_u+(j+.5)*image_height/n*pixel_delta_v;
+				hit_record rec;
+				if(scene.hit_surface(ray(center,target-center),interval(err,infty),rec))seen=bounding_box(seen,bounding_box(rec.p,rec.p));
+			}
+		bounding_box box=scene.bbox();
+		if(!(seen.x.size()>=0))return box;
+		interval* axes[3]={&seen.x,&seen.y,&seen.z};
+		const interval* bounds[3]={&box.x,&box.y,&box.z};
+		for(int a=0;a<3;a++){
+			axes[a]->expand(axes[a]->size());
+			*axes[a]=interval(std::max(axes[a]->min,bounds[a]->min),std::min(axes[a]->max,bounds[a]->max));
+		}
+		return seen;
+	}
+
 	void init(){
 		image_height=std::max(1.,image_width/aspect_ratio);
 
@@ -127,7 +318,7 @@ class camera{
 		pixel_delta_u=viewport_u/image_width;
 		pixel_delta_v=viewport_v/image_height;
 
-		viewport_upper_left=center-focus_dist*w-viewport_u/2-viewport_v/2;
+		point3 viewport_upper_left=center-focus_dist*w-viewport_u/2-viewport_v/2;
 		pixel00_loc=viewport_upper_left+0.5*(pixel_delta_u+pixel_delta_v);
 
 		double defocus_radius=focus_dist*tan(deg_to_rad(defocus_angle)/2);
@@ -139,83 +330,484 @@ class camera{
 		while(x*x+y*y>=1.0)x=random_double(-1,1),y=random_double(-1,1);
 		return center+x*defocus_u+y*defocus_v;
 	}
+
+	// Camera ray of sample s of the spp samples of pixel (i,j). Seeds this thread's generator and
+	// starts smp on that sample; the filter offset, lens and time take its first dimensions, and
+	// weight gets the filter weight of the sample.
+	ray camera_ray(int i, int j, int s, int spp, sampler& smp, double& weight){
+		seed_random(j*image_width+i,s);
+		smp.start_pixel_sample(i,j,s,spp);
+		vec2 offset=filter->sample(smp.next_2d(),weight);
+		point3 pixel_sample=pixel00_loc+(i+offset.u)*pixel_delta_u+(j+offset.v)*pixel_delta_v;
+		point3 ray_origin=sample_in_defocus_disk();
+		double ray_time=random_double();
+		return ray(ray_origin,normalize(pixel_sample-ray_origin),ray_time);
+	}
+	// Where a camera sample stands in its random sequences, so its path can be put aside and
+	// resumed later.
+	struct sample_state{
+		pcg32 rng;
+		int dimension;
+	};
+	static sample_state save_sample(const sampler& smp){ return sample_state{random_generator(),smp.dimension()};}
+	static void resume_sample(sampler& smp, int i, int j, int s, int spp, const sample_state& state){
+		random_generator()=state.rng;
+		smp.start_pixel_sample(i,j,s,spp);
+		smp.set_dimension(state.dimension);
+	}
+	// Filter-weighted running sum of the samples of one pixel, in float. Alongside it keeps the
+	// mean and squared deviations of the weighted samples (Welford), for the variance estimate.
+	struct pixel_accumulator{
+		float sum[3]={0,0,0},weight_sum=0;
+		float mean[3]={0,0,0},m2[3]={0,0,0};
+		int count=0;
+		void add(const color& c, double weight){
+			float x[3]={float(weight*c.e0),float(weight*c.e1),float(weight*c.e2)};
+			count++,weight_sum+=weight;
+			for(int k=0;k<3;k++){
+				sum[k]+=x[k];
+				float delta=x[k]-mean[k];
+				mean[k]+=delta/count;
+				m2[k]+=delta*(x[k]-mean[k]);
+			}
+		}
+		color value()const{
+			if(weight_sum==0)return color(0,0,0);
+			return color(sum[0],sum[1],sum[2])/weight_sum;
+		}
+		// Variance of value(), treating the weight sum as exact.
+		color variance()const{
+			if(count<2||weight_sum==0)return color(0,0,0);
+			double scale=double(count)/(count-1)/(double(weight_sum)*weight_sum);
+			return color(m2[0],m2[1],m2[2])*scale;
+		}
+	};
+	color background_radiance(const ray& r)const{ return environment?environment->radiance(r.direction()):background;}
+	static color drop_nan(color c){
+		if(c.e0!=c.e0)c.e0=0;
+		if(c.e1!=c.e1)c.e1=0;
+		if(c.e2!=c.e2)c.e2=0;
+		return c;
+	}
 	
-	color ray_color(const ray& r, const shared_ptr<hittable>& obj, const shared_ptr<hittable>& lights, const double p, const int depth){
-		if(depth<=0)return color(0,0,0);
+	// State of one camera path between two bounces.
+	struct path_state{
+		ray r;
+		color throughput,radiance;
+		int depth;
+		double scatter_pdf;//density of r.direction() at its origin, 0 if it left a specular bounce
+		bool diffuse;//the last bounce was diffuse and gathered caustics
+		bool caustic;//specular bounces since that one, so the caustic map stands for the lights it finds that cast photons
+		path_state(const ray& r): r(r),throughput(1,1,1),radiance(0,0,0),depth(0),scatter_pdf(0),diffuse(false),caustic(false){}
+	};
+
+	color ray_color(const ray& r, const hittable& scene, const hittable& lights){
+		path_state path(r);
+		hit_record rec;
+		bool hit=scene.hit_surface(r,interval(err,infty),rec);
+		return trace_path(path,hit,rec,scene,lights);
+	}
+	// Follows a path from its first intersection (or miss) until it leaves the scene, is absorbed,
+	// reaches max_depth, is ended by Russian roulette or reads the radiance cache; returns the
+	// radiance it gathered.
+	color trace_path(path_state& path, bool hit, hit_record& rec, const hittable& scene, const hittable& lights){
+		auto light_sample=[&](const ray& light_ray,const color& weight,const light_point* resampled){
+			color incident=resampled?resampled_radiance(light_ray,*resampled,scene,lights):incident_radiance(light_ray,scene,lights);
+			path.radiance+=make_safe(weight*incident);
+		};
+		guide_vertex vertices[max_guide_vertices];
+		cache_vertex cached[max_cache_vertices];
+		int num_vertices=0,num_cached=0;
+		//footprint areas of the path (Muller et al., Real-time Neural Radiance Caching for Path
+		//Tracing, 2021): the camera's from the first hit, and the sum along the bounces after it
+		double primary_spread=0,spread=0;
+		for(int vertex=0;hit;vertex++){
+			int depth=path.depth;
+			bool record=false;
+			if(cache){
+				double dist=length(rec.p-path.r.origin()),cos_theta=std::fabs(dot(rec.normal,normalize(path.r.direction())));
+				if(!vertex)primary_spread=square(dist)/(4*pi*cos_theta);
+				else if(path.scatter_pdf>0)spread+=std::sqrt(square(dist)/(path.scatter_pdf*cos_theta));
+			}
+			if(cache&&rec.mat->emit(path.r,rec)<=color(0,0,0)){
+				color reflected;
+				if(vertex&&square(spread)>cache_spread*primary_spread&&cache->lookup(rec.p,rec.normal,reflected)){
+					path.radiance+=make_safe(path.throughput*reflected);
+					break;
+				}
+				if(num_cached<max_cache_vertices)cached[num_cached]=cache_vertex{rec.p,rec.normal,path.throughput,path.radiance},record=true;
+			}
+			bool alive=shade(path,rec,lights,light_sample);
+			//only a vertex that drew from an importance-sampled (diffuse) lobe, and so counts the
+			//paths Russian roulette ends there, goes into the cache
+			if(record&&path.depth>depth&&path.scatter_pdf>0)num_cached++;
+			if(!alive)break;
+			if(guide_training&&path.scatter_pdf>0&&num_vertices<max_guide_vertices)
+				vertices[num_vertices++]=guide_vertex{path.r,path.throughput,path.radiance,path.scatter_pdf};
+			hit=scene.hit_surface(path.r,interval(err,infty),rec);
+		}
+		if(!hit&&!(path.caustic&&environment))path.radiance+=make_safe(path.throughput*background_radiance(path.r)*emission_weight(path,lights));
+		//the radiance a direction brought back is what the path gathered after it, over the throughput there
+		for(int k=0;k<num_vertices;k++){
+			const guide_vertex& v=vertices[k];
+			color incident=per_throughput(path.radiance-v.radiance,v.throughput);
+			guide->record(v.r.origin(),v.r.direction(),luminance(incident),v.pdf);
+		}
+		//and the radiance a vertex reflected is what the path gathered from it on
+		for(int k=0;k<num_cached;k++)
+			cache->add(cached[k].p,cached[k].normal,per_throughput(path.radiance-cached[k].radiance,cached[k].throughput));
+		return path.radiance;
+	}
+	// A direction a training path left a vertex in, with the path's throughput and radiance then.
+	struct guide_vertex{
+		ray r;
+		color throughput,radiance;
+		double pdf;
+	};
+	static const int max_guide_vertices=16;
+	// A vertex whose reflected radiance goes into the cache, with the path's throughput and
+	// radiance as it arrived there.
+	struct cache_vertex{
+		point3 p;
+		vec3 normal;
+		color throughput,radiance;
+	};
+	static const int max_cache_vertices=16;
+	static color per_throughput(const color& gathered, const color& throughput){
+		color c;
+		for(int k=0;k<3;k++)c[k]=throughput[k]>0?gathered[k]/throughput[k]:0;
+		return drop_nan(c);
+	}
+	// Weight of radiance found by following the sampled direction, against the light samples
+	// taken at the same vertex (power-2 heuristic). With no lights the light strategy samples the
+	// whole sphere, so the background takes part too; an environment is one of the lights.
+	double emission_weight(const path_state& path, const hittable& lights)const{
+		if(path.scatter_pdf<=0)return 1;
+		double w_light=light_samples*lights.sample_pdf(path.r);
+		return square(path.scatter_pdf)/(square(path.scatter_pdf)+square(w_light));
+	}
+	// Radiance arriving along a light sample. When the ray meets one of the lights, that light's
+	// emission counts unless an any-hit query finds a blocker in front of it; otherwise the ray
+	// falls back to a closest hit against the scene.
+	color incident_radiance(const ray& r, const hittable& scene, const hittable& lights){
+		hit_record rec;
+		if(lights.hit_surface(r,interval(err,infty),rec)){
+			color emitted=rec.mat->emit(r,rec);
+			if(emitted<=0||scene.occluded(r,rec.t*(1-1e-6)))return color(0,0,0);
+			return emitted;
+		}
+		if(!scene.hit_surface(r,interval(err,infty),rec))return background_radiance(r);
+		return rec.mat->emit(r,rec);
+	}
+	// A light sample of resampled light sampling: a point on one of the lights, or, where the
+	// light it was drawn from has no surface, a direction to the background. weight, emitted and
+	// jacobian belong to the shading point whose reservoir holds it: the BSDF term f there, the
+	// radiance the light sends it, and the change from solid angle there to the sample's measure
+	// (area on the light, solid angle for a direction).
+	struct light_point{
+		const hittable* light;
+		vec3 x;
+		bool distant;
+		color weight,emitted;
+		double jacobian;
+	};
+	// A path vertex with what the target function needs there, and the reservoir of its light
+	// candidates.
+	struct shading_point{
+		ray r;
 		hit_record rec;
-		if(!obj->hit(r,interval(err,infty),rec))return background;
 		scatter_record scatter;
-		ray scattered_ray;
+		const direction_tree* guided;
+		color throughput;
+		reservoir<light_point> light;
+	};
+	static ray light_ray(const shading_point& s, const light_point& y){
+		return ray(s.rec.p,y.distant?y.x:y.x-s.rec.p,s.r.time());
+	}
+	// Target function of resampled light sampling at s for the sample of light along light_ray:
+	// the luminance of f*Le without shadowing, in the measure of the sample, which goes to y. With
+	// expected given, the ray must reach the same point or background direction, otherwise the
+	// target is 0: a sample found at another shading point counts at s only where s could have
+	// drawn it too.
+	double light_target(const shading_point& s, const hittable* light, const ray& light_ray, light_point& y,
+						const light_point* expected=nullptr){
+		vec3 bsdf=s.rec.mat->bsdf(s.r,s.rec,light_ray);
+		if(bsdf<=0)return 0;
+		const vec3& d=light_ray.direction();
+		hit_record rec;
+		y.light=light;
+		if(light->hit_surface(light_ray,interval(err,infty),rec)){
+			if(expected&&(expected->distant||std::abs(rec.t-1)>1e-4))return 0;
+			double length=d.length(),distance=rec.t*length;
+			y.x=rec.p,y.distant=0,y.emitted=rec.mat->emit(light_ray,rec);
+			y.jacobian=std::abs(dot(rec.normal,d))/(length*distance*distance);
+		}
+		else{
+			if(expected&&!expected->distant)return 0;
+			y.x=normalize(d),y.distant=1,y.emitted=background_radiance(light_ray),y.jacobian=1;
+		}
+		y.weight=s.scatter.attenuation(d)*bsdf;
+		return std::max(0.,luminance(y.weight*y.emitted))*y.jacobian;
+	}
+	// Fills s.light with one light sample picked out of light_candidates drawn from the lights, in
+	// proportion to target function over density (resampled importance sampling). A candidate
+	// costs one descent to a single light and no shadow ray; only the picked one gets traced.
+	void resample_light(shading_point& s, const hittable& lights){
+		s.light=reservoir<light_point>();
+		for(int c=0;c<light_candidates;c++){
+			double prob=1;
+			const hittable* light=lights.pick_light(s.rec.p,random_double(),prob);
+			ray candidate(s.rec.p,light->sample(s.rec.p,s.r.time()),s.r.time());
+			light_point y;
+			double target=light_target(s,light,candidate,y);
+			double density=target>0?prob*light->sample_pdf(candidate)*y.jacobian:0;
+			s.light.update(y,target,density>0?target/density:0,random_double());
+		}
+	}
+	// Weight of the shadow ray of light sample y at s with contribution weight W: the throughput,
+	// f, the MIS weight against the BSDF sample taken at s, and W.
+	color resampled_weight(const shading_point& s, const light_point& y, double W, const hittable& lights){
+		ray r=light_ray(s,y);
+		double w_light=lights.sample_pdf(r);
+		if(!(w_light>0))return color(0,0,0);
+		double w_surface=sampling_pdf(s.scatter,s.guided).value(r.direction());
+		double w=square(light_samples*w_light)/(square(w_surface)+square(light_samples*w_light));
+		return s.throughput*y.weight*(w*y.jacobian*W);
+	}
+	// Radiance arriving along the shadow ray r of light sample y: its emission unless something is
+	// in the way. A direction to the background that meets a surface takes that surface's
+	// emission instead, unless the surface is a light, whose own samples count it.
+	color resampled_radiance(const ray& r, const light_point& y, const hittable& scene, const hittable& lights){
+		if(!y.distant)return scene.occluded(r,1-1e-6)?color(0,0,0):y.emitted;
+		hit_record rec,light_rec;
+		if(!scene.hit_surface(r,interval(err,infty),rec))return y.emitted;
+		if(lights.hit(r,interval(err,rec.t*(1+1e-6)),light_rec))return color(0,0,0);
+		return rec.mat->emit(r,rec);
+	}
+
+	// Whether the caustic map already carries the emission seen at rec: it does when rec lies on
+	// one of the lights the photons were traced from and its emission doesn't fade with distance.
+	// Other emitters cast no photons, so paths keep their light.
+	bool in_caustic_map(const ray& r, const hit_record& rec)const{
+		hit_record light_rec;
+		return photon_sources&&!rec.mat->attenuated()&&photon_sources->hit_surface(r,interval(err,rec.t*(1+1e-6)),light_rec)&&light_rec.t>=rec.t*(1-1e-6);
+	}
+	// Caustic radiance reflected at rec toward r: the power of the photons within the radius,
+	// weighted by the BSDF, over the area of the disk.
+	color caustic_radiance(const ray& r, const hit_record& rec, const scatter_record& scatter)const{
+		color sum(0,0,0);
+		photons->gather(rec.p,[&](const photon_map::photon& photon){
+			double cos_theta=-dot(rec.normal,photon.direction);
+			if(cos_theta<=0)return;
+			ray incoming(rec.p,-photon.direction,r.time());
+			sum+=scatter.attenuation(incoming.direction())*rec.mat->bsdf(r,rec,incoming)*photon.power/cos_theta;
+		});
+		return sum/(pi*square(photons->radius()));
+	}
+
+	// Density the continuation of a path is drawn from: the material's own, mixed with the path
+	// guide's distribution where one has been learned.
+	mixed_pdf<guided_pdf,pdf> sampling_pdf(const scatter_record& scatter, const direction_tree* guided)const{
+		return mixed_pdf<guided_pdf,pdf>(guided_pdf(guided),scatter.sample_pdf,guided?guide_fraction:0);
+	}
+
+	// Handles the vertex rec of a path: adds its emission to the radiance, hands every light sample
+	// to light_sample(ray,weight,resampled), whose contribution is weight times the radiance
+	// arriving along the ray (to light sample *resampled, if not null), and moves the path on to
+	// its next ray. Returns false once the path has ended. When resampling with deferred given,
+	// the reservoir is left in *deferred for spatial reuse instead.
+	template<typename F>
+	bool shade(path_state& path, const hit_record& rec, const hittable& lights, F&& light_sample,
+			   shading_point* deferred=nullptr){
+		const ray& r=path.r;
 		color emitted=rec.mat->emit(r,rec);
-		vec3 bsdf;
-		if(!rec.mat->scatter(r,rec,scatter))return emitted;
+		if(!(emitted<=0)&&!(path.caustic&&in_caustic_map(r,rec)))
+			path.radiance+=make_safe(path.throughput*emitted*emission_weight(path,lights));
+		if(path.depth+1>=max_depth)return false;
+		scatter_record scatter;
+		if(!rec.mat->scatter(r,rec,scatter))return false;
 		if(!scatter.using_importance_sampling){
-			scattered_ray=scatter.sample_ray;
-			bool extra_bounce=scatter.path_unchanged;
-			return make_safe(scatter.attenuation(scattered_ray.direction())
-				   *ray_color(scattered_ray,obj,lights,p,depth-1+extra_bounce))+emitted;
-		}
-		if(depth==1)return emitted;
-		auto light_pdf=make_shared<directed_pdf>(lights, rec.p);
-		auto surface_pdf=scatter.sample_pdf;
-		if(random_double()<=std::max(p,pow(depth,-1.66667))){//Russian Roulette
-			const int num_sample=5;
-			color accum=emitted;
-			for(int T=0;T<num_sample;T++){
-				scattered_ray=ray(rec.p,light_pdf->sample(),r.time());
-				double w_light=light_pdf->value(scattered_ray.direction());
-				if(w_light!=w_light)continue;
-				bsdf=make_safe(rec.mat->bsdf(r,rec,scattered_ray));
-				if(!(bsdf<=0))accum+=make_safe(scatter.attenuation(scattered_ray.direction())*bsdf
-					   			 	 *ray_color(scattered_ray,obj,lights,p,1)/(w_light*num_sample));
-			}
-			return accum;
-		}
-		//MIS with power-2 heuristic
-		const int num_sample_light=3;
-		double w_surface,w_light,w;
-		color accum=emitted;
-		scattered_ray=ray(rec.p,surface_pdf->sample(),r.time());
-		bsdf=rec.mat->bsdf(r,rec,scattered_ray);
-		if(!(bsdf<=0)){
-			w_surface=surface_pdf->value(scattered_ray.direction());
-			w_light=light_pdf->value(scattered_ray.direction());
-			w=square(w_surface)/(square(w_surface)+square(num_sample_light*w_light));
-			accum+=make_safe(scatter.attenuation(scattered_ray.direction())*bsdf*w
-				   *ray_color(scattered_ray,obj,lights,p,depth-1)/w_surface);
-		}
-		for(int T=0;T<num_sample_light;T++){
-			scattered_ray=ray(rec.p,light_pdf->sample(),r.time());
-			bsdf=rec.mat->bsdf(r,rec,scattered_ray);
-			if(!(bsdf<=0)){
-				w_light=light_pdf->value(scattered_ray.direction());
-				w_surface=surface_pdf->value(scattered_ray.direction());
-				w=square(num_sample_light*w_light)/(square(w_surface)+square(num_sample_light*w_light));
-				accum+=make_safe(scatter.attenuation(scattered_ray.direction())*bsdf*w
-					   *ray_color(scattered_ray,obj,lights,p,1)/(w_light*num_sample_light));
+			path.throughput*=make_safe(scatter.attenuation(scatter.sample_ray.direction()));
+			if(!scatter.path_unchanged)path.depth++,path.caustic|=path.diffuse,path.diffuse=false;
+			path.r=scatter.sample_ray,path.scatter_pdf=0;
+			return !(path.throughput<=0);
+		}
+		if(photons){
+			path.radiance+=make_safe(path.throughput*caustic_radiance(r,rec,scatter));
+			path.diffuse=true,path.caustic=false;
+		}
+		directed_pdf light_pdf(&lights,rec.p);
+		const direction_tree* guided=guide?guide->distribution(rec.p):nullptr;
+		mixed_pdf<guided_pdf,pdf> surface_pdf=sampling_pdf(scatter,guided);
+		if(resampling){
+			shading_point vertex{r,rec,scatter,guided,path.throughput};
+			resample_light(vertex,lights);
+			if(deferred)*deferred=vertex;
+			else if(vertex.light.target>0){
+				const light_point& y=vertex.light.sample;
+				light_sample(light_ray(vertex,y),resampled_weight(vertex,y,vertex.light.contribution_weight(),lights),&y);
 			}
 		}
-		return accum;
-	}
-
-	color anti_aliasing(color* buffer, int row, int col, int pool_num){
-		int pool_num_r=std::min(pool_num,row),pool_num_c=std::min(pool_num,col);
-		color res(0,0,0);
-		for(int i=0;i<pool_num_r;i++)
-			for(int j=0;j<pool_num_c;j++){
-				int lr=1ll*i*row/pool_num_r,rr=1ll*(i+1)*row/pool_num_r;
-				int lc=1ll*j*col/pool_num_c,rc=1ll*(j+1)*col/pool_num_c;
-				color tmp(0,0,0);
-				for(int si=lr;si<rr;si++)
-					for(int sj=lc;sj<rc;sj++)
-						tmp+=buffer[si*col+sj];
-				tmp/=1ll*(rr-lr)*(rc-lc);
-				if(tmp.e0>1)tmp.e0=1;
-				if(tmp.e1>1)tmp.e1=1;
-				if(tmp.e2>1)tmp.e2=1;
-				res+=tmp*(rr-lr)*(rc-lc);
+		//light samples, MIS with power-2 heuristic
+		else for(int T=0;T<light_samples;T++){
+			ray light_ray(rec.p,light_pdf.sample(),r.time());
+			vec3 bsdf=rec.mat->bsdf(r,rec,light_ray);
+			if(bsdf<=0)continue;
+			double w_light=light_pdf.value(light_ray.direction());
+			if(!(w_light>0))continue;
+			double w_surface=surface_pdf.value(light_ray.direction());
+			double w=square(light_samples*w_light)/(square(w_surface)+square(light_samples*w_light));
+			light_sample(light_ray,path.throughput*scatter.attenuation(light_ray.direction())*bsdf*w/(w_light*light_samples),nullptr);
+		}
+		//surface sample continues the path
+		ray scattered_ray(rec.p,surface_pdf.sample(),r.time());
+		vec3 bsdf=rec.mat->bsdf(r,rec,scattered_ray);
+		if(bsdf<=0)return false;
+		double w_surface=surface_pdf.value(scattered_ray.direction());
+		path.throughput*=make_safe(scatter.attenuation(scattered_ray.direction())*bsdf/w_surface);
+		path.r=scattered_ray,path.scatter_pdf=w_surface,path.depth++;
+		//Russian roulette on the path throughput
+		if(path.depth>=rr_depth){
+			double q=std::min(0.95,std::max(path.throughput.e0,std::max(path.throughput.e1,path.throughput.e2)));
+			if(!(random_double()<q))return false;
+			path.throughput/=q;
+		}
+		return !(path.throughput<=0);
+	}
+
+	struct shadow_ray{
+		int path;
+		ray r;
+		color weight;
+		bool resampled;
+		light_point light;//when resampled
+	};
+	// Storage of one wavefront batch, kept per worker so that batches reuse it.
+	struct wavefront_batch{
+		std::vector<path_state> paths;
+		std::vector<sample_state> states;
+		std::vector<double> weights;
+		std::vector<hit_record> recs;
+		std::vector<char> hit;
+		std::vector<int> active,next;
+		std::vector<std::pair<const material*,int> > queue;
+		std::vector<shadow_ray> shadows;
+		std::vector<shading_point> vertices;//primary vertices waiting for spatial reuse
+		std::vector<int> sources;
+	};
+	// Renders a tile a batch of paths at a time. Every bounce runs as separate stages: intersect
+	// all live paths, sort the hits into per-material queues, shade each queue in one go (which
+	// emits the next-bounce rays and a batch of shadow rays), then trace the shadow rays. Each
+	// path keeps its own generator and sampler state, so the image matches the path-at-a-time mode
+	// unless reuse_neighbours has the primary vertices share light reservoirs, which only this mode
+	// can do: all of them are shaded before any shadow ray is traced.
+	void render_tile_wavefront(int x0, int y0, int x1, int y1, int spp, const hittable& scene, const hittable& lights,
+							   sampler& smp, color* tile_buffer, wavefront_batch& b){
+		int width=x1-x0,num_pixels=width*(y1-y0);
+		int pixels_per_batch=std::max(1,wavefront_size/spp);
+		bool reuse=resampling&&reuse_neighbours>0;
+		for(int first=0;first<num_pixels;first+=pixels_per_batch){
+			int n=(std::min(num_pixels,first+pixels_per_batch)-first)*spp;
+			b.paths.clear(),b.states.resize(n),b.weights.resize(n),b.recs.resize(n),b.hit.resize(n),b.active.resize(n);
+			for(int k=0;k<n;k++){
+				int pixel=first+k/spp;
+				b.paths.push_back(path_state(camera_ray(x0+pixel%width,y0+pixel/width,k%spp,spp,smp,b.weights[k])));
+				b.states[k]=save_sample(smp);
+				b.active[k]=k;
 			}
-		return res/(row*col);
+			if(reuse)b.vertices.resize(n);
+			for(bool primary=true;!b.active.empty();primary=false){
+				//intersection stage; camera rays of a pixel go through the BVH as packets
+				if(primary)
+					for(int k0=0;k0<n;k0+=ray_packet::max_size){
+						ray_packet packet;
+						interval ray_t[ray_packet::max_size];
+						for(int k=k0;k<std::min(n,k0+ray_packet::max_size);k++)
+							ray_t[packet.size]=interval(err,infty),packet.add(b.paths[k].r);
+						int hit_mask=scene.hit_packet(packet,packet.all(),ray_t,&b.recs[k0]);
+						for(int k=0;k<packet.size;k++)
+							if((b.hit[k0+k]=hit_mask>>k&1))b.recs[k0+k].obj->compute_surface_interaction(packet.rays[k],b.recs[k0+k]);
+					}
+				else for(int k:b.active)b.hit[k]=scene.hit_surface(b.paths[k].r,interval(err,infty),b.recs[k]);
+				//misses pick up the background and end, hits join the queue of their material
+				b.queue.clear();
+				for(int k:b.active){
+					path_state& path=b.paths[k];
+					if(b.hit[k])b.queue.push_back(std::make_pair(b.recs[k].mat,k));
+					else if(!(path.caustic&&environment))path.radiance+=make_safe(path.throughput*background_radiance(path.r)*emission_weight(path,lights));
+				}
+				std::sort(b.queue.begin(),b.queue.end());
+				//shading stage
+				b.next.clear(),b.shadows.clear();
+				if(primary&&reuse)
+					for(int k=0;k<n;k++)b.vertices[k].light.count=0;
+				for(auto& q:b.queue){
+					int k=q.second,pixel=first+k/spp;
+					resume_sample(smp,x0+pixel%width,y0+pixel/width,k%spp,spp,b.states[k]);
+					if(shade(b.paths[k],b.recs[k],lights,[&](const ray& light_ray,const color& weight,const light_point* resampled){
+						b.shadows.push_back(shadow_ray{k,light_ray,weight,resampled!=nullptr,resampled?*resampled:light_point()});
+					},primary&&reuse?&b.vertices[k]:nullptr))b.next.push_back(k);
+					b.states[k]=save_sample(smp);
+				}
+				//spatial reuse stage, whose shadow rays join the others
+				if(primary&&reuse)
+					for(int k=0;k<n;k++)
+						if(b.vertices[k].light.count){
+							int pixel=first+k/spp;
+							resume_sample(smp,x0+pixel%width,y0+pixel/width,k%spp,spp,b.states[k]);
+							reuse_light(b,k,first,n,spp,width,lights);
+							b.states[k]=save_sample(smp);
+						}
+				//shadow stage
+				for(auto& shadow:b.shadows){
+					color incident=shadow.resampled?resampled_radiance(shadow.r,shadow.light,scene,lights)
+												   :incident_radiance(shadow.r,scene,lights);
+					b.paths[shadow.path].radiance+=make_safe(shadow.weight*incident);
+				}
+				std::swap(b.active,b.next);
+			}
+			for(int k0=0;k0<n;k0+=spp){
+				int pixel=first+k0/spp;
+				pixel_accumulator acc;
+				for(int k=k0;k<k0+spp;k++)acc.add(drop_nan(b.paths[k].radiance),b.weights[k]);
+				tile_buffer[pixel/width*tile_size+pixel%width]=acc.value();
+				if(track_variance)pixel_variance[(y0+pixel/width)*image_width+x0+pixel%width]=acc.variance();
+			}
+		}
+	}
+	// Spatial reuse (ReSTIR) at primary vertex k of a batch: merges into its reservoir those of
+	// reuse_neighbours random primary vertices of the same sample index within reuse_radius
+	// pixels, valued by k's target function, and queues the shadow ray of the sample picked. A
+	// reservoir's candidates count only if its own target function is nonzero at that sample (the
+	// 1/Z weight of Bitterli et al.), so neighbours that see other lights leave no bias.
+	void reuse_light(wavefront_batch& b, int k, int first, int n, int spp, int width, const hittable& lights){
+		const shading_point& s=b.vertices[k];
+		int pixel=first+k/spp;
+		reservoir<light_point> out;
+		out.merge(s.light,s.light.sample,s.light.target,random_double());
+		b.sources.assign(1,k);
+		for(int t=0;t<reuse_neighbours;t++){
+			int column=pixel%width+random_int(2*reuse_radius+1)-reuse_radius;
+			int other=(pixel/width+random_int(2*reuse_radius+1)-reuse_radius)*width+column;
+			if(column<0||column>=width||other<first||other>=first+n/spp||other==pixel)continue;
+			int q=(other-first)*spp+k%spp;
+			const reservoir<light_point>& neighbour=b.vertices[q].light;
+			if(!neighbour.count)continue;
+			const light_point& x=neighbour.sample;
+			light_point y;
+			double target=neighbour.target>0?light_target(s,x.light,light_ray(s,x),y,&x):0;
+			out.merge(neighbour,y,target,random_double());
+			b.sources.push_back(q);
+		}
+		if(!(out.target>0))return;
+		int z=0;
+		for(int q:b.sources){
+			light_point y;
+			const shading_point& source=b.vertices[q];
+			if(q==k||light_target(source,out.sample.light,light_ray(source,out.sample),y,&out.sample)>0)z+=source.light.count;
+		}
+		const light_point& y=out.sample;
+		b.shadows.push_back(shadow_ray{k,light_ray(s,y),resampled_weight(s,y,out.weight_sum/(z*out.target),lights),true,y});
 	}
 };
 
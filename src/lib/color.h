@@ -17,6 +17,8 @@ inline color linear_to_srgb(color c){
     return color(linear_to_srgb_channel(c.e0),linear_to_srgb_channel(c.e1),linear_to_srgb_channel(c.e2));
 }
 
+inline double luminance(const color& c){ return 0.2126*c.e0+0.7152*c.e1+0.0722*c.e2;}
+
 inline double gamma_correction(double x){return pow(linear_to_srgb_channel(x),0.7);}
 
 inline void write_color(std::ostream& out, const color& pixel_color){
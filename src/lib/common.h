@@ -7,6 +7,8 @@
 #include<float.h>
 #include<memory>
 #include<string>
+#include<algorithm>
+#include "rng.h"
 
 using std::shared_ptr;
 using std::make_shared;
@@ -15,8 +17,43 @@ const double infty=1e100;
 const double pi=3.1415926535897932384626433832795;
 const double err=1e-6;
 
-inline double random_double(){ return (std::rand()/(RAND_MAX+1.)+std::rand())/(RAND_MAX+1.);}
+inline pcg32& random_generator(){
+	static thread_local pcg32 generator;
+	return generator;
+}
+inline uint64_t& random_seed(){
+	static uint64_t seed=0;
+	return seed;
+}
+inline void seed_random(uint64_t seed){ random_seed()=seed,random_generator().set_seed(mix_bits(seed));}
+// Restarts this thread's generator on the sequence owned by one sample of one pixel, so a render
+// is reproducible regardless of the number of threads or the order in which tiles are run.
+inline void seed_random(uint64_t pixel, uint64_t sample){
+	random_generator().set_seed(mix_bits(random_seed()^mix_bits(pixel)),sample);
+}
+
+// Where random_double() and random_int() draw from on this thread. While a camera sample is being
+// traced it points at the camera's sampler (see sampler.h), so each draw along the path takes the
+// next sample dimension; otherwise draws come straight from the thread's generator.
+class sample_source{
+  public:
+	virtual ~sample_source(){}
+	virtual double next_1d()=0;
+};
+inline sample_source*& active_sample_source(){
+	static thread_local sample_source* source=nullptr;
+	return source;
+}
+
+inline double random_double(){
+	sample_source* source=active_sample_source();
+	return source?source->next_1d():random_generator().next_double();
+}
 inline double random_double(double min, double max){ return min+(max-min)*random_double();}
+inline int random_int(int n){
+	sample_source* source=active_sample_source();
+	return source?std::min(n-1,int(source->next_1d()*n)):random_generator().next_uint(n);
+}
 
 inline double deg_to_rad(double x){ return x/180*pi;}
 inline double rad_to_deg(double x){ return x*180/pi;}
@@ -27,6 +64,7 @@ template<typename T>
 inline T make_safe(T x){ return x==x?x:T(0);}
 
 inline int argmax(int a,int b,int c){ return a>=b?(a>=c?0:2):(b>=c?1:2);}
+inline int argmax(double a,double b,double c){ return a>=b?(a>=c?0:2):(b>=c?1:2);}
 
 template<typename T>
 T linear_interpolate(T a[2], double u){
@@ -0,0 +1,101 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "common.h"
+#include "hittable.h"
+#include "alias_table.h"
+#include "rtw_stb_image.h"
+
+#include<vector>
+
+// Light arriving from infinitely far away in every direction, given by a lat-long
+// (equirectangular) image: column u covers the angle phi=2*pi*u around +y, row v the angle
+// theta=pi*v down from +y. As a light it draws directions pixel by pixel from an alias table
+// weighted by luminance times sin(theta), the area a pixel takes on the sphere, so bright parts
+// of the sky get the light samples. It never takes part in intersection; the camera looks it up
+// for rays that leave the scene.
+class environment_light: public hittable{
+  public:
+	environment_light(const char* filename, double intensity=1){
+		rtw_image image(filename);
+		width=image.width(),height=image.height();
+		if(!width||!height||!image.linear_pixel_data(0,0)){
+			std::clog<<"Environment map "<<filename<<" has no HDR data, using black"<<std::endl;
+			width=height=1;
+			pixels.assign(1,color(0,0,0));
+		}
+		else
+			for(int j=0;j<height;j++)
+				for(int i=0;i<width;i++){
+					const float* pixel=image.linear_pixel_data(i,j);
+					pixels.push_back(intensity*color(pixel[0],pixel[1],pixel[2]));
+				}
+		build_distribution();
+	}
+	// Sky of a single color, sampled uniformly.
+	environment_light(const color& radiance): width(64), height(32), pixels(64*32,radiance){ build_distribution();}
+
+	color radiance(const vec3& direction)const{
+		point2 uv=direction_to_uv(normalize(direction));
+		return pixels[pixel_index(uv)];
+	}
+
+	bool hit(const ray& r, const interval& ray_t, hit_record& rec)const override{ return 0;}
+	bool occluded(const ray& r, double t_max)const override{ return 0;}
+	bounding_box bbox()const override{ return bounding_box::universe;}
+	double sample_pdf(const ray& r)const override{
+		point2 uv=direction_to_uv(normalize(r.direction()));
+		double sin_theta=sin(pi*uv.v);
+		if(sin_theta<=0)return 0;
+		return distribution.probability(pixel_index(uv))*width*height/(2*pi*pi*sin_theta);
+	}
+	vec3 sample(const point3& origin, const double time)const override{
+		int k=distribution.sample(random_double());
+		double u=random_double(),v=random_double();
+		return uv_to_direction(point2((k%width+u)/width,(k/width+v)/height));
+	}
+	// Photon arriving from the environment onto box: a direction drawn like sample(), and a start
+	// on the disk across it that covers the box's bounding sphere, outside the sphere.
+	bool sample_photon(const bounding_box& box, double time, ray& r, color& power)const{
+		point3 c((box.x.min+box.x.max)/2,(box.y.min+box.y.max)/2,(box.z.min+box.z.max)/2);
+		double radius=length(vec3(box.x.size(),box.y.size(),box.z.size()))/2;
+		vec3 d=sample(c,time);
+		double pdf=sample_pdf(ray(c,d,time));
+		color L=radiance(d);
+		if(!(pdf>0)||L<=0||!(radius>0))return 0;
+		double s=radius*std::sqrt(random_double()),phi=2*pi*random_double();
+		point3 origin=c+orthonormal_basis::around(d).to_standard(vec3(s*cos(phi),s*sin(phi),radius));
+		r=ray(origin,-d,time);
+		power=L*(pi*radius*radius/pdf);
+		return 1;
+	}
+
+  private:
+	int width,height;
+	std::vector<color> pixels;//row by row from the top
+	alias_table distribution;
+
+	void build_distribution(){
+		std::vector<double> weights(width*height);
+		for(int j=0;j<height;j++){
+			double sin_theta=sin(pi*(j+.5)/height);
+			for(int i=0;i<width;i++)weights[j*width+i]=std::max(0.,luminance(pixels[j*width+i]))*sin_theta;
+		}
+		distribution=alias_table(weights);
+	}
+	int pixel_index(const point2& uv)const{
+		int i=std::min(width-1,int(uv.u*width)),j=std::min(height-1,int(uv.v*height));
+		return j*width+i;
+	}
+	static point2 direction_to_uv(const vec3& d){
+		double phi=atan2(d.z(),d.x());
+		if(phi<0)phi+=2*pi;
+		return point2(phi/(2*pi),acos(std::max(-1.,std::min(1.,d.y())))/pi);
+	}
+	static vec3 uv_to_direction(const point2& uv){
+		double phi=2*pi*uv.u,theta=pi*uv.v;
+		return vec3(sin(theta)*cos(phi),cos(theta),sin(theta)*sin(phi));
+	}
+};
+
+#endif
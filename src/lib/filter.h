@@ -0,0 +1,95 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "common.h"
+#include<vector>
+#include<algorithm>
+
+// Pixel reconstruction filters for filter importance sampling: instead of splatting every sample
+// into the pixels it overlaps, each pixel draws its own samples around its centre with density
+// proportional to |f| and weights them by f/pdf. All filters here are separable, f(x,y)=f(x)f(y),
+// and are sampled through a table of |f| per axis.
+class pixel_filter{
+  public:
+	double radius;//in pixels
+
+	virtual ~pixel_filter()=default;
+	virtual double profile(double x)const=0;//the 1D filter, zero outside [-radius,radius]
+	double evaluate(const vec2& p)const{ return profile(p.u)*profile(p.v);}
+
+	// Offset from the pixel centre for u in [0,1)^2; weight gets f/pdf of the offset, which for
+	// a filter that is never negative is the same for all offsets.
+	vec2 sample(const point2& u, double& weight)const{
+		double wx,wy;
+		vec2 offset(sample_1d(u.u,wx),sample_1d(u.v,wy));
+		weight=wx*wy;
+		return offset;
+	}
+
+  protected:
+	pixel_filter(double radius): radius(radius){}
+	// Builds the sampling table; called by the constructor of each filter once profile() works.
+	void tabulate(){
+		cdf.assign(table_size+1,0);
+		for(int i=0;i<table_size;i++)
+			cdf[i+1]=cdf[i]+std::abs(profile(-radius+(i+0.5)*2*radius/table_size));
+		for(int i=1;i<=table_size;i++)cdf[i]/=cdf[table_size];
+	}
+
+  private:
+	static const int table_size=64;
+	std::vector<double> cdf;
+
+	double sample_1d(double u, double& weight)const{
+		int i=std::upper_bound(cdf.begin(),cdf.end(),u)-cdf.begin()-1;
+		i=std::max(0,std::min(table_size-1,i));
+		double width=cdf[i+1]-cdf[i];
+		double x=-radius+(i+(width>0?(u-cdf[i])/width:0.5))*2*radius/table_size;
+		weight=width>0?profile(x)/(width*table_size/(2*radius)):0;
+		return x;
+	}
+};
+
+// Uniform over the pixel, the plain jittered pixel sample.
+class box_filter: public pixel_filter{
+  public:
+	box_filter(double radius=0.5): pixel_filter(radius){ tabulate();}
+	double profile(double x)const override{ return std::abs(x)<=radius;}
+};
+
+// Gaussian shifted down so that it reaches zero at the radius.
+class gaussian_filter: public pixel_filter{
+  public:
+	gaussian_filter(double radius=1.5, double sigma=0.5): pixel_filter(radius),sigma(sigma){ tabulate();}
+	double profile(double x)const override{ return std::max(0.,gaussian(x)-gaussian(radius));}
+  private:
+	double sigma;
+	double gaussian(double x)const{ return exp(-x*x/(2*sigma*sigma));}
+};
+
+// Mitchell-Netravali cubic; its negative lobes give some of the samples negative weights.
+class mitchell_filter: public pixel_filter{
+  public:
+	mitchell_filter(double radius=2, double b=1./3, double c=1./3): pixel_filter(radius),b(b),c(c){ tabulate();}
+	double profile(double x)const override{
+		x=std::abs(2*x/radius);
+		if(x>2)return 0;
+		if(x>1)return ((-b-6*c)*x*x*x+(6*b+30*c)*x*x+(-12*b-48*c)*x+(8*b+24*c))/6;
+		return ((12-9*b-6*c)*x*x*x+(-18+12*b+6*c)*x*x+(6-2*b))/6;
+	}
+  private:
+	double b,c;
+};
+
+// Four-term Blackman-Harris window over [-radius,radius].
+class blackman_harris_filter: public pixel_filter{
+  public:
+	blackman_harris_filter(double radius=1.5): pixel_filter(radius){ tabulate();}
+	double profile(double x)const override{
+		if(std::abs(x)>radius)return 0;
+		double t=2*pi*(x/radius+1)/2;
+		return 0.35875-0.48829*cos(t)+0.14128*cos(2*t)-0.01168*cos(3*t);
+	}
+};
+
+#endif
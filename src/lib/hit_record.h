@@ -8,12 +8,16 @@ class hittable;
 
 class hit_record{
   public:
-	const void* obj;
+	//filled by hittable::hit
+	const hittable* obj;//object whose compute_surface_interaction completes the record
+	int prim_id;
+	point2 uv;//where the primitive was hit: barycentrics, quad coordinates
+	double t;
+	//filled by compute_surface_interaction
 	point3 p;
 	vec3 normal;
 	bool outer_face;
-	std::shared_ptr<material> mat;
-	double t;
+	const material* mat;//owned by the primitive that was hit
 	point2 tex_coord;
 	inline void set_normal(const ray& r,const vec3& outward_normal){
 		normal= dot(r.direction(),outward_normal)<0 ? outer_face=1,outward_normal : (outer_face=0,-outward_normal);
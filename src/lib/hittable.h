@@ -4,15 +4,103 @@
 #include "common.h"
 #include "hit_record.h"
 #include "bounding_box.h"
+#include "ray_packet.h"
+#include "light_bounds.h"
+#include "orthonormal_basis.h"
+#include<atomic>
+#include<cstdint>
+#include<cstring>
+
+// Per-thread memory of the primitive that blocked the last shadow ray of an aggregate. Shadow rays
+// from nearby points tend to be blocked by the same primitive, so it is tested first next time.
+// Aggregates share a small direct-mapped table keyed by an id each gets from new_occluder_id().
+// Worker threads outlive scenes; unlike an address, an id is never reused by a later aggregate.
+struct occluder_cache{
+	uint64_t owner=0;//id of the aggregate, 0 for none
+	int prim;
+};
+inline uint64_t new_occluder_id(){
+	static std::atomic<uint64_t> next{0};
+	return ++next;
+}
+inline occluder_cache& last_occluder(uint64_t owner){
+	static thread_local occluder_cache table[16];
+	return table[mix_bits(owner)&15];
+}
+
+// Stochastic alpha test of a candidate hit at distance t along r: whether a surface of the given
+// opacity stops the ray there. It hashes the ray and t instead of drawing from the thread's
+// generator, so repeated traversals of one ray agree and no random numbers are consumed.
+inline bool alpha_test(double opacity, const ray& r, double t){
+	if(opacity>=1)return 1;
+	if(opacity<=0)return 0;
+	double key[7]={r.origin().x(),r.origin().y(),r.origin().z(),
+				   r.direction().x(),r.direction().y(),r.direction().z(),t};
+	uint64_t h=random_seed();
+	for(double x:key){
+		uint64_t bits;
+		std::memcpy(&bits,&x,sizeof(bits));
+		h=mix_bits(h^bits);
+	}
+	return (h>>11)*0x1.0p-53<opacity;
+}
 
 class hittable{
   public:
 	virtual ~hittable()=default;
+	// Closest hit inside ray_t. Only the cheap part of the record (obj, prim_id, uv, t) is filled,
+	// the rest is left to compute_surface_interaction once the closest hit is final.
 	virtual bool hit(const ray& r, const interval& ray_t, hit_record& rec)const=0;
+	// Fills p, normal, outer_face, mat and tex_coord of a record that hit() pointed at this object.
+	virtual void compute_surface_interaction(const ray& r, hit_record& rec)const{}
+	// Closest hit with the whole record filled in.
+	bool hit_surface(const ray& r, const interval& ray_t, hit_record& rec)const{
+		if(!hit(r,ray_t,rec))return 0;
+		rec.obj->compute_surface_interaction(r,rec);
+		return 1;
+	}
 	virtual bounding_box bbox()const=0;
 	virtual double sample_pdf(const ray& r)const=0;
 	virtual vec3 sample(const point3& origin, const double time=0)const=0;
+	// The light among those this object is made of that sample() draws from for u in [0,1),
+	// with the chance of drawing it multiplied into prob. A single light is its own.
+	virtual const hittable* pick_light(const point3& origin, double u, double& prob)const{ return this;}
 	virtual const void* get_pointer()const{return this;}
+	// Whether this is a set of lights with nothing in it to sample. A single object is a light.
+	virtual bool empty()const{ return 0;}
+	// Bounds on what this object emits, for light selection. Objects that cannot tell report no
+	// power.
+	virtual light_bounds emission_bounds()const{ return light_bounds(bbox(),0);}
+	// Draws a photon leaving this light at time: its ray, and its power, the emitted radiance over
+	// the density the ray was drawn with. False when no photon leaves, as for objects that cannot
+	// emit them.
+	virtual bool sample_photon(double time, ray& r, color& power)const{ return 0;}
+	// Whether anything blocks r within (err,t_max). Stops at the first blocker and computes no
+	// surface attributes; objects without a cheaper test fall back to a closest hit.
+	virtual bool occluded(const ray& r, double t_max)const{
+		hit_record rec;
+		return hit(r,interval(err,t_max),rec);
+	}
+	// Closest hits for the rays of a packet whose bits are set in active. Every ray that finds a
+	// hit inside ray_t[i] gets rec[i] filled, ray_t[i].max moved to it and bit i set in the
+	// returned mask. Objects without a packet path trace the rays one by one.
+	virtual int hit_packet(const ray_packet& packet, int active, interval ray_t[], hit_record rec[])const{
+		int hit_mask=0;
+		for(int i=0;i<packet.size;i++)
+			if(active>>i&1&&hit(packet.rays[i],ray_t[i],rec[i]))ray_t[i].max=rec[i].t,hit_mask|=1<<i;
+		return hit_mask;
+	}
 };
 
+// Photon leaving point p of a diffuse emitter in a cosine-distributed direction around normal n,
+// for radiance L at p and p drawn with density area_pdf. Two-sided emitters pick a side first.
+inline bool diffuse_photon(const point3& p, const vec3& n, const color& L, double area_pdf, bool two_sided,
+						   double time, ray& r, color& power){
+	if(L<=0||!(area_pdf>0))return 0;
+	bool back=two_sided&&random_double()<0.5;
+	r=ray(p,orthonormal_basis::around(back?-n:n).to_standard(random_lambertian_direction()),time);
+	power=L*(pi*(two_sided?2:1)/area_pdf);
+	return 1;
+}
+
 #endif
\ No newline at end of file
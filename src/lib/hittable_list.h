@@ -10,7 +10,7 @@ class hittable_list: public hittable{
 	std::vector<std::shared_ptr<hittable> > objects;
 	hittable_list(){}
 	hittable_list(std::shared_ptr<hittable> object){ clear(),add(object);}
-	hittable_list(std::vector<std::shared_ptr<hittable> > objects): objects(objects){}
+	hittable_list(std::vector<std::shared_ptr<hittable> > objects){ for(auto& object:objects)add(object);}
 
 	inline void add(std::shared_ptr<hittable> object){ 
 		objects.push_back(object);
@@ -20,25 +20,50 @@ class hittable_list: public hittable{
 
 	bool hit(const ray& r, const interval& ray_t, hit_record& rec)const override{
 		bool flag=0;
-		hit_record tmp;
 		double ctmin=ray_t.max;
-		for(auto obj:objects)
-			if(obj->hit(r,ray_t,tmp))
-				if(tmp.t<ctmin)ctmin=tmp.t,rec=tmp,flag=1;
+		for(const auto& obj:objects)
+			if(obj->hit(r,interval(ray_t.min,ctmin),rec))ctmin=rec.t,flag=1;
 		return flag;
 	}
+	bool occluded(const ray& r, double t_max)const override{
+		for(const auto& obj:objects)
+			if(obj->occluded(r,t_max))return 1;
+		return 0;
+	}
 	bounding_box bbox()const override{ return boundingbox;}
+	bool empty()const override{
+		for(const auto& obj:objects)
+			if(!obj->empty())return 0;
+		return 1;
+	}
 	double sample_pdf(const ray& r)const override{
 		if(objects.empty())return 1/(4*pi);
 		double accum=0;
-		for(auto object:objects)accum+=object->sample_pdf(r);
+		for(const auto& object:objects)accum+=object->sample_pdf(r);
 		return accum/objects.size();
 	}
+	light_bounds emission_bounds()const override{
+		if(objects.empty())return light_bounds(boundingbox,0);
+		light_bounds b=objects[0]->emission_bounds();
+		for(size_t i=1;i<objects.size();i++)b=light_bounds(b,objects[i]->emission_bounds());
+		return b;
+	}
 	vec3 sample(const point3& origin, const double time)const override{
 		if(objects.empty())return random_unit_vector();
-		int i=rand()%objects.size();
+		int i=random_int(objects.size());
 		return objects[i]->sample(origin,time);
 	}
+	const hittable* pick_light(const point3& origin, double u, double& prob)const override{
+		if(objects.empty())return this;
+		int n=objects.size(),i=std::min(int(u*n),n-1);
+		prob/=n;
+		return objects[i]->pick_light(origin,u*n-i,prob);
+	}
+	bool sample_photon(double time, ray& r, color& power)const override{
+		if(objects.empty()||!objects[random_int(objects.size())]->sample_photon(time,r,power))return 0;
+		power*=objects.size();
+		return 1;
+	}
   private:
 	bounding_box boundingbox;
 };
@@ -0,0 +1,99 @@
+#ifndef LIGHT_BOUNDS_H
+#define LIGHT_BOUNDS_H
+
+#include "common.h"
+#include "bounding_box.h"
+
+// Bounds on the emission of a light or a group of lights, used to pick lights in proportion to
+// how much they may contribute (Conty Estevez and Kulla, Importance Sampling of Many Lights with
+// Adaptive Tree Splitting, 2018): where the emitters are, their total power phi, a cone around w
+// holding all their normals (half-angle theta_o), and theta_e, how far past its normal a surface
+// still emits (pi/2 for a flat emitter).
+class light_bounds{
+  public:
+	bounding_box box;
+	double phi=0;
+	vec3 w=vec3(0,0,1);
+	double cos_theta_o=-1,cos_theta_e=0;
+	bool two_sided=true;
+
+	light_bounds(){}
+	light_bounds(const bounding_box& box, double phi, const vec3& w=vec3(0,0,1), double cos_theta_o=-1,
+				 double cos_theta_e=0, bool two_sided=true)
+		:box(box), phi(phi), w(w), cos_theta_o(cos_theta_o), cos_theta_e(cos_theta_e), two_sided(two_sided){}
+	light_bounds(const light_bounds& a, const light_bounds& b)
+		:box(a.box,b.box), phi(a.phi+b.phi), w(a.w), cos_theta_o(a.cos_theta_o),
+		 cos_theta_e(std::min(a.cos_theta_e,b.cos_theta_e)), two_sided(a.two_sided||b.two_sided){
+		merge_cone(w,cos_theta_o,b.w,b.cos_theta_o);
+	}
+
+	point3 center()const{ return point3((box.x.min+box.x.max)/2,(box.y.min+box.y.max)/2,(box.z.min+box.z.max)/2);}
+	vec3 extent()const{ return vec3(box.x.size(),box.y.size(),box.z.size());}
+
+	// Upper estimate of the light arriving at p: power over squared distance, scaled by the cosine
+	// of the smallest angle any emitter in the bounds can make with the direction to p.
+	double importance(const point3& p)const{
+		if(phi<=0)return 0;
+		vec3 d=p-center();
+		double radius_squared=extent().length_squared()/4;
+		double dist_squared=std::max(d.length_squared(),radius_squared);
+		double cos_theta_w=dot(w,normalize(d));
+		if(two_sided)cos_theta_w=std::abs(cos_theta_w);
+		if(!(cos_theta_w==cos_theta_w))cos_theta_w=1;//p at the centre
+		double sin_theta_w=std::sqrt(std::max(0.,1-cos_theta_w*cos_theta_w));
+		//angle taken by the box as seen from p
+		double cos_theta_b=-1,sin_theta_b=0;
+		if(d.length_squared()>radius_squared){
+			double sin2=radius_squared/d.length_squared();
+			cos_theta_b=std::sqrt(1-sin2),sin_theta_b=std::sqrt(sin2);
+		}
+		//theta'=max(0,theta_w-theta_o-theta_b)
+		double sin_theta_o=std::sqrt(std::max(0.,1-cos_theta_o*cos_theta_o));
+		double cos_theta_x=cos_minus(sin_theta_w,cos_theta_w,sin_theta_o,cos_theta_o);
+		double sin_theta_x=sin_minus(sin_theta_w,cos_theta_w,sin_theta_o,cos_theta_o);
+		double cos_theta_p=cos_minus(sin_theta_x,cos_theta_x,sin_theta_b,cos_theta_b);
+		if(cos_theta_p<=cos_theta_e)return 0;
+		return phi*cos_theta_p/dist_squared;
+	}
+	// Solid angle measure of the emitted directions, the orientation factor of the surface area
+	// orientation heuristic used to build light trees.
+	double orientation_measure()const{
+		double theta_o=acos(clamp(cos_theta_o,-1,1)),theta_e=acos(clamp(cos_theta_e,-1,1));
+		double theta_w=std::min(theta_o+theta_e,pi),sin_theta_o=sin(theta_o);
+		return 2*pi*(1-cos_theta_o)+pi/2*(2*theta_w*sin_theta_o-cos(theta_o-2*theta_w)-2*theta_o*sin_theta_o+cos_theta_o);
+	}
+
+	// Widens the cone (w,cos_theta) to also hold the cone (w2,cos_theta2).
+	static void merge_cone(vec3& w, double& cos_theta, const vec3& w2, double cos_theta2){
+		double theta_a=acos(clamp(cos_theta,-1,1)),theta_b=acos(clamp(cos_theta2,-1,1));
+		double theta_d=acos(clamp(dot(w,w2),-1,1));
+		if(std::min(theta_d+theta_b,pi)<=theta_a)return;
+		if(std::min(theta_d+theta_a,pi)<=theta_b){
+			w=w2,cos_theta=cos_theta2;
+			return;
+		}
+		double theta_o=(theta_a+theta_d+theta_b)/2;
+		vec3 axis=cross(w,w2);
+		if(theta_o>=pi||axis.length_squared()<1e-20){
+			cos_theta=-1;
+			return;
+		}
+		//rotate w towards w2 by theta_o-theta_a
+		axis=normalize(axis);
+		double theta_r=theta_o-theta_a;
+		w=normalize(w*cos(theta_r)+cross(axis,w)*sin(theta_r));
+		cos_theta=cos(theta_o);
+	}
+
+  private:
+	static double clamp(double x, double lo, double hi){ return std::max(lo,std::min(hi,x));}
+	// cos and sin of max(0,a-b), from the sines and cosines of a and b
+	static double cos_minus(double sin_a, double cos_a, double sin_b, double cos_b){
+		return cos_a>cos_b?1:cos_a*cos_b+sin_a*sin_b;
+	}
+	static double sin_minus(double sin_a, double cos_a, double sin_b, double cos_b){
+		return cos_a>cos_b?0:sin_a*cos_b-cos_a*sin_b;
+	}
+};
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include "common.h"
+#include "hittable.h"
+
+#include<vector>
+#include<algorithm>
+
+// Set of lights for next event estimation that draws lights by importance instead of uniformly.
+// The lights are the leaves of a binary tree whose nodes carry light_bounds. A light is drawn by
+// walking down from the root and taking each child with probability proportional to its
+// importance at the shading point, so near and bright lights are drawn more often than far and
+// dim ones. The density of a direction repeats the walk, but only into nodes whose boxes the ray
+// meets, so both cost O(log n) for a scene of many small lights. The same boxes serve hit() and
+// occluded().
+class light_tree: public hittable{
+  public:
+	light_tree(const std::vector<shared_ptr<hittable> >& lights): lights(lights){
+		if(lights.empty())return;
+		std::vector<light_bounds> bounds;
+		double total=0;
+		for(auto& light:lights)bounds.push_back(light->emission_bounds()),total+=bounds.back().phi;
+		//lights whose emission can't be estimated still need some chance of being drawn
+		for(auto& b:bounds)
+			if(!(b.phi>0))b.phi=total>0?1e-3*total/lights.size():1;
+		std::vector<int> order(lights.size());
+		for(int i=0;i<(int)order.size();i++)order[i]=i;
+		build(bounds,order,0,order.size(),0);
+	}
+
+	bool hit(const ray& r, const interval& ray_t, hit_record& rec)const override{
+		if(nodes.empty())return 0;
+		interval t=ray_t;
+		bool hit_anything=0;
+		int stack[stack_size],top=0;
+		stack[top++]=0;
+		while(top){
+			int id=stack[--top];
+			const node& cur=nodes[id];
+			if(!cur.bounds.box.hit(r,t))continue;
+			if(cur.light>=0){
+				if(lights[cur.light]->hit(r,t,rec))t.max=rec.t,hit_anything=1;
+				continue;
+			}
+			stack[top++]=cur.second_child,stack[top++]=id+1;
+		}
+		return hit_anything;
+	}
+	bool occluded(const ray& r, double t_max)const override{
+		if(nodes.empty())return 0;
+		interval t(err,t_max);
+		int stack[stack_size],top=0;
+		stack[top++]=0;
+		while(top){
+			int id=stack[--top];
+			const node& cur=nodes[id];
+			if(!cur.bounds.box.hit(r,t))continue;
+			if(cur.light>=0){
+				if(lights[cur.light]->occluded(r,t_max))return 1;
+				continue;
+			}
+			stack[top++]=cur.second_child,stack[top++]=id+1;
+		}
+		return 0;
+	}
+	bounding_box bbox()const override{ return nodes.empty()?bounding_box():nodes[0].bounds.box;}
+	bool empty()const override{ return lights.empty();}
+	double sample_pdf(const ray& r)const override{
+		if(nodes.empty())return 1/(4*pi);
+		return sample_pdf(0,1,r);
+	}
+	vec3 sample(const point3& origin, const double time)const override{
+		if(nodes.empty())return random_unit_vector();
+		double prob=1;
+		return pick_light(origin,random_double(),prob)->sample(origin,time);
+	}
+	const hittable* pick_light(const point3& origin, double u, double& prob)const override{
+		if(nodes.empty())return this;
+		int id=0;
+		while(nodes[id].light<0){
+			double p=first_child_probability(id,origin);
+			if(u<p)id=id+1,u/=p,prob*=p;
+			else id=nodes[id].second_child,u=(u-p)/(1-p),prob*=1-p;
+			u=std::min(u,1-1e-12);
+		}
+		return lights[nodes[id].light]->pick_light(origin,u,prob);
+	}
+	light_bounds emission_bounds()const override{ return nodes.empty()?light_bounds():nodes[0].bounds;}
+	// Photons come from a light drawn by power: the walk down takes each child by its share.
+	bool sample_photon(double time, ray& r, color& power)const override{
+		if(nodes.empty())return 0;
+		int id=0;
+		double prob=1;
+		while(nodes[id].light<0){
+			double phi0=nodes[id+1].bounds.phi,phi1=nodes[nodes[id].second_child].bounds.phi;
+			double p=phi0+phi1>0?phi0/(phi0+phi1):0.5;
+			if(random_double()<p)id=id+1,prob*=p;
+			else id=nodes[id].second_child,prob*=1-p;
+		}
+		if(!lights[nodes[id].light]->sample_photon(time,r,power))return 0;
+		power/=prob;
+		return 1;
+	}
+
+  private:
+	// Nodes in depth-first order: the first child of an inner node follows it, the second is at
+	// second_child. Leaves hold exactly one light.
+	struct node{
+		light_bounds bounds;
+		int light=-1,second_child=0;
+	};
+	//binned splits stop at depth 32 and halving takes over, so the depth stays below 64
+	static const int binned_depth=32,stack_size=66;
+	static const int num_bins=12;
+	std::vector<shared_ptr<hittable> > lights;
+	std::vector<node> nodes;
+
+	double first_child_probability(int id, const point3& p)const{
+		double i0=nodes[id+1].bounds.importance(p),i1=nodes[nodes[id].second_child].bounds.importance(p);
+		if(!(i0+i1>0))return 0.5;
+		return i0/(i0+i1);
+	}
+	double sample_pdf(int id, double p, const ray& r)const{
+		const node& cur=nodes[id];
+		if(p<=0||!cur.bounds.box.hit(r,interval(err,infty)))return 0;
+		if(cur.light>=0)return p*lights[cur.light]->sample_pdf(r);
+		double p0=first_child_probability(id,r.origin());
+		return sample_pdf(id+1,p*p0,r)+sample_pdf(cur.second_child,p*(1-p0),r);
+	}
+
+	void build(std::vector<light_bounds>& bounds, std::vector<int>& order, int l, int r, int depth){
+		int id=nodes.size();
+		nodes.push_back(node());
+		if(r-l==1){
+			nodes[id].bounds=bounds[order[l]];
+			nodes[id].light=order[l];
+			return;
+		}
+		int mid=split(bounds,order,l,r,depth);
+		build(bounds,order,l,mid,depth+1);
+		nodes[id].second_child=nodes.size();
+		build(bounds,order,mid,r,depth+1);
+		nodes[id].bounds=light_bounds(nodes[id+1].bounds,nodes[nodes[id].second_child].bounds);
+	}
+
+	// Splits order[l,r) in two with the binned surface area orientation heuristic: the cost of a
+	// side is its power times its orientation measure times its surface area, with a penalty for
+	// cutting across the thin axis of a flat group. Falls back to halving along the widest axis.
+	int split(std::vector<light_bounds>& bounds, std::vector<int>& order, int l, int r, int depth){
+		bounding_box centroids,box;
+		for(int i=l;i<r;i++){
+			point3 c=bounds[order[i]].center();
+			centroids=bounding_box(centroids,bounding_box(c,c));
+			box=bounding_box(box,bounds[order[i]].box);
+		}
+		vec3 extent(box.x.size(),box.y.size(),box.z.size());
+		vec3 centroid_extent(centroids.x.size(),centroids.y.size(),centroids.z.size());
+		double max_extent=std::max(extent.x(),std::max(extent.y(),extent.z()));
+		int best_axis=-1,best_bin=0;
+		double best_cost=infty;
+		if(depth<binned_depth)
+			for(int axis=0;axis<3;axis++){
+				if(centroid_extent[axis]<=1e-9)continue;
+				light_bounds bins[num_bins];
+				int counts[num_bins]={0};
+				for(int i=l;i<r;i++){
+					int b=bin_of(bounds[order[i]],centroids,axis);
+					bins[b]=counts[b]++?light_bounds(bins[b],bounds[order[i]]):bounds[order[i]];
+				}
+				double regularization=max_extent/std::max(extent[axis],1e-9);
+				for(int k=0;k<num_bins-1;k++){
+					light_bounds left,right;
+					int count_left=0,count_right=0;
+					for(int b=0;b<=k;b++)
+						if(counts[b])left=count_left?light_bounds(left,bins[b]):bins[b],count_left+=counts[b];
+					for(int b=k+1;b<num_bins;b++)
+						if(counts[b])right=count_right?light_bounds(right,bins[b]):bins[b],count_right+=counts[b];
+					if(!count_left||!count_right)continue;
+					double cost=regularization*(cost_of(left)+cost_of(right));
+					if(cost<best_cost)best_cost=cost,best_axis=axis,best_bin=k;
+				}
+			}
+		if(best_axis>=0){
+			int mid=std::partition(order.begin()+l,order.begin()+r,[&](int i){
+				return bin_of(bounds[i],centroids,best_axis)<=best_bin;
+			})-order.begin();
+			if(mid>l&&mid<r)return mid;
+		}
+		int axis=centroid_extent.x()>centroid_extent.y()?(centroid_extent.x()>centroid_extent.z()?0:2)
+													   :(centroid_extent.y()>centroid_extent.z()?1:2);
+		int mid=(l+r)/2;
+		std::nth_element(order.begin()+l,order.begin()+mid,order.begin()+r,[&](int a,int b){
+			return bounds[a].center()[axis]<bounds[b].center()[axis];
+		});
+		return mid;
+	}
+	static int bin_of(const light_bounds& b, const bounding_box& centroids, int axis){
+		const interval& range=axis==0?centroids.x:axis==1?centroids.y:centroids.z;
+		int k=(b.center()[axis]-range.min)/range.size()*num_bins;
+		return std::max(0,std::min(num_bins-1,k));
+	}
+	static double cost_of(const light_bounds& b){ return b.phi*b.orientation_measure()*b.box.area();}
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include "camera.h"
 #include "hittable_list.h"
 #include "mesh.h"
+#include "light_tree.h"
 
 #include<vector>
 
@@ -15,12 +16,20 @@ class scene{
 	std::vector<camera> cameras;
 	std::vector<shared_ptr<hittable> > objects;
 	std::vector<shared_ptr<hittable> > lights;
+	std::vector<shared_ptr<hittable> > distant_lights;//directional lights, kept out of the light tree
 	std::vector<shared_ptr<material> > materials;
 	std::vector<int> is_light;
 
 	void render(int cam_id){
 		auto object=make_shared<bvh_node>(objects,0,(int)objects.size());
-		auto light=make_shared<hittable_list>(lights);
+		shared_ptr<hittable> light=make_shared<light_tree>(lights);
+		//a directional light is a far quad whose emission grows with the squared distance, which
+		//light bounds can't weigh against nearby lights, so the suns take half of the samples
+		if(!distant_lights.empty()){
+			auto both=make_shared<hittable_list>(make_shared<hittable_list>(distant_lights));
+			if(!lights.empty())both->add(light);
+			light=both;
+		}
 		cameras[cam_id].render(object,light);
 	}
 
@@ -136,11 +145,11 @@ class scene{
 				auto light=make_shared<quad>(p+onb.u+onb.v,-2*onb.u,-2*onb.v,
 											 make_shared<diffuse_light>(Light->mColorDiffuse/25,1,0,0));
 				objects.push_back(light);
-				lights.push_back(light);
+				distant_lights.push_back(light);
 			}
 		}
 
-		if(lights.empty()){
+		if(lights.empty()&&distant_lights.empty()){
 			std::clog<<"No light!"<<std::endl;
 		}
 
@@ -13,6 +13,25 @@ class material{
 	virtual bool scatter(const ray& ray_in, const hit_record& rec, scatter_record& scatter)const{return 0;}
 	virtual vec3 bsdf(const ray& ray_in, const hit_record& rec, const ray& ray_out)const{return 0;}
 	virtual color emit(const ray& ray_in, const hit_record& rec)const{return color(0,0,0);}
+	// Radiance emitted at a surface point, before any distance attenuation; used to weigh lights
+	// and parts of lights against each other.
+	virtual color emission(const point2& tex_coord, const point3& p)const{return color(0,0,0);}
+	// Whether emit() scales emission() with the distance from the viewer. Photons can't carry such
+	// light, so these emitters cast none.
+	virtual bool attenuated()const{return false;}
+	// Rough average of emission() over an 8x8 grid of texture coordinates.
+	color mean_emission()const{
+		color sum(0,0,0);
+		for(int i=0;i<8;i++)
+			for(int j=0;j<8;j++)sum+=emission(point2((i+.5)/8,(j+.5)/8),point3(0,0,0));
+		return sum/64;
+	}
+	// Cut-out support: primitives with an alpha-tested material call opacity() on every candidate
+	// hit during traversal and let the ray through with probability 1-opacity.
+	virtual bool alpha_tested()const{return false;}
+	virtual double opacity(const point2& tex_coord, const point3& p)const{return 1;}
+	// Direction dependent attenuation of a scatter record whose lobe points at this material.
+	virtual color attenuation(const scatter_record& scatter, const vec3& dir)const{return scatter.weight;}
 };
 
 class lambertian: public material{
@@ -24,9 +43,9 @@ class lambertian: public material{
 		vec3 scattered_direction=random_unit_vector()+rec.normal;
 		while(scattered_direction.length_squared()<1e-12)
 			scattered_direction=random_unit_vector()+rec.normal;
-		scatter.attenuation=[=](const vec3& v)->const color{return tex->value(rec.tex_coord,rec.p);};
+		scatter.weight=tex->value(rec.tex_coord,rec.p);
 		scatter.using_importance_sampling=true;
-		scatter.sample_pdf=make_shared<lambertian_pdf>(rec.normal);
+		scatter.sample_pdf=lambertian_pdf(rec.normal);
 		return 1;
 	}
 	vec3 bsdf(const ray& ray_in, const hit_record& rec, const ray& ray_out)const override{
@@ -42,7 +61,7 @@ class metal: public material{
 	metal(const shared_ptr<texture>& tex, double fuzz): tex(tex), fuzz(std::min(fuzz,1.)){}
 	bool scatter(const ray& ray_in, const hit_record& rec, scatter_record& scatter)const override{
 		vec3 new_direction=normalize(reflect(ray_in.direction(),rec.normal))+random_unit_vector()*fuzz;
-		scatter.attenuation=[=](const vec3& v)->const color{return tex->value(rec.tex_coord,rec.p);};
+		scatter.weight=tex->value(rec.tex_coord,rec.p);
 		scatter.using_importance_sampling=false;
 		scatter.sample_ray=ray(rec.p,new_direction,ray_in.time());
 		return dot(new_direction,rec.normal)>0;
@@ -59,7 +78,7 @@ class dielectric: public material{
 	bool scatter(const ray& ray_in, const hit_record& rec, scatter_record& scatter)const override{
 		vec3 in_direction=normalize(ray_in.direction());
 		double eta=rec.outer_face?1/refraction_rate:refraction_rate;
-		scatter.attenuation=[=](const vec3& v)->const color{return tex->value(rec.tex_coord,rec.p);};
+		scatter.weight=tex->value(rec.tex_coord,rec.p);
 		scatter.using_importance_sampling=false;
 		scatter.sample_ray=ray(rec.p,refract(in_direction,rec.normal,eta),ray_in.time());
 		return 1;
@@ -93,6 +112,10 @@ class diffuse_light: public material {
 		double atten=1/((attenuation_const*invd+attenuation_linear)*invd+attenuation_quadratic);
 		return (tex->value(rec.tex_coord,rec.p))*atten;
 	}
+	color emission(const point2& tex_coord, const point3& p)const override{ return tex->value(tex_coord,p);}
+	bool attenuated()const override{
+		return attenuation_const!=0||attenuation_linear!=0||attenuation_quadratic!=1;
+	}
   private:
 	shared_ptr<texture> tex;
 	double attenuation_const,attenuation_linear,attenuation_quadratic;
@@ -102,20 +125,18 @@ class transparent: public material{
   public:
 	transparent(const shared_ptr<material>& mat, double alpha=1): alpha(alpha), mat(mat){}
 
+	//rays pass through in traversal, so every hit that reaches the material is on the opaque part
 	bool scatter(const ray& ray_in, const hit_record& rec, scatter_record& scatter)const override{
-		if(random_double()>=alpha){
-			scatter.attenuation=[=](const vec3& v)->const color{return color(1,1,1);};
-			scatter.using_importance_sampling=false;
-			scatter.sample_ray=ray(rec.p,ray_in.direction(),ray_in.time());
-			return true;
-		}
-		bool scattered=mat->scatter(ray_in,rec,scatter);
-		return scattered;
+		return mat->scatter(ray_in,rec,scatter);
 	}
 	vec3 bsdf(const ray& ray_in, const hit_record& rec, const ray& ray_out)const override{
-		return alpha*mat->bsdf(ray_in,rec,ray_out);
+		return mat->bsdf(ray_in,rec,ray_out);
 	}
+	bool alpha_tested()const override{return alpha<1;}
+	double opacity(const point2& tex_coord, const point3& p)const override{return alpha;}
 	color emit(const ray& ray_in, const hit_record& rec)const override{return mat->emit(ray_in,rec);}
+	color emission(const point2& tex_coord, const point3& p)const override{return mat->emission(tex_coord,p);}
+	bool attenuated()const override{return mat->attenuated();}
   private:
 	double alpha;
 	shared_ptr<material> mat;
@@ -129,7 +150,7 @@ class PrincipledBSDF : public material {
 	double emitted_intensity;
     double roughness;
     double metalness;
-    double opacity;
+    double opacity_factor;
     double ior;
 	double transmission;
     vec3 f0;  // Fresnel
@@ -141,6 +162,8 @@ class PrincipledBSDF : public material {
         f0 = metalness * metalness_f0 + (1.0 - metalness) * dielectric_f0;
     }
 
+	enum{diffuse_lobe,specular_lobe};
+
 	double pow5(double x)const{double y=x*x;return y*y*x;}
 
     vec3 schlick_fresnel(double cos_theta) const {
@@ -188,7 +211,7 @@ class PrincipledBSDF : public material {
 		  emitted_intensity(emitted_intensity),
           roughness(std::max(roughness,0.001)), 
           metalness(metalness), 
-          opacity(opacity), 
+          opacity_factor(opacity), 
           ior(ior),
 		  transmission(transmission) {
         calculate_f0();
@@ -199,15 +222,6 @@ class PrincipledBSDF : public material {
         vec3 n = rec.normal; // Surface normal
         vec3 v = -normalize(ray_in.direction()); // View vector
 
-        // Handle opacity
-        if (random_double() >= opacity) {
-            scatter.using_importance_sampling = false;
-			scatter.path_unchanged = true;
-            scatter.sample_ray = ray(rec.p, ray_in.direction(), ray_in.time());
-            scatter.attenuation = [](const vec3&) { return vec3(1.0); }; // Pass through
-            return true;
-        }
-
 		const double max_transmission_ratio = 0.8;
 
 		double ratio_transmission = transmission * (1 - metalness) * max_transmission_ratio;
@@ -240,70 +254,74 @@ class PrincipledBSDF : public material {
 
 			scatter.using_importance_sampling = false;
 			scatter.sample_ray = ray(rec.p, l, ray_in.time());
-			scatter.attenuation = [=](const vec3& p){
-				return vec3(1,1,1)* (1-f) * g * cos_theta_v / 
-					   ((abs(dot(v,n)) * dot(h,n) + 1e-50) * num_attempt * max_transmission_ratio);
-			};
+			scatter.weight = vec3(1,1,1)* (1-f) * g * cos_theta_v / 
+							 ((abs(dot(v,n)) * dot(h,n) + 1e-50) * num_attempt * max_transmission_ratio);
 			return true;
 		}
 
         //If roughness not very low, use importance sampling
 		if(roughness > 0.1){
 			scatter.using_importance_sampling = true;
-			auto pdf_diffuse   = make_shared<lambertian_pdf>(n);
-			auto pdf_specular  = make_shared<ggx_reflect_pdf>(n, v, roughness);
-			scatter.sample_pdf = make_shared<mixed_pdf>(pdf_diffuse, pdf_specular, 
-														(0.6 + 0.2 * roughness) * (1 - metalness));
-			scatter.attenuation = [=](const vec3& v){return color(1,1,1) / (1 - ratio_transmission);};
+			lambertian_pdf pdf_diffuse(n);
+			ggx_reflect_pdf pdf_specular(n, v, roughness);
+			scatter.sample_pdf = lambertian_ggx_pdf(pdf_diffuse, pdf_specular, 
+													(0.6 + 0.2 * roughness) * (1 - metalness));
+			scatter.weight = color(1,1,1) / (1 - ratio_transmission);
 		}
 		else{//Otherwise there would be a sharp highlight, process diff and spec separately
 			double ratio = (0.6 + 0.2 * roughness) * (1 - metalness);
 			if(random_double() < ratio){
 				scatter.using_importance_sampling = true;
-				scatter.sample_pdf    = make_shared<lambertian_pdf>(n);
-				scatter.attenuation = [=](const vec3& l){
-					vec3 ll = normalize(l);
-					vec3 h = normalize(v + l); // Half vector
-					double von=dot(v,n), lon=dot(l,n);
-					if( von<=0 || lon<=0)return vec3(1,1,1);
-					double voh=dot(v,h),hon=dot(h,n);
-
-        			// Specular term
-        			vec3 f = schlick_fresnel(voh);
-        			double g = geometry_smith(von) * geometry_smith(lon);
-        			double d = distribution_ggx(hon);
-        			vec3 specular = f * g * d / (4.0 * abs(von) + 1e-50);
-
-        			// Diffuse term
-					double fd90 = 0.5 + 2 * roughness * square(voh);
-					double fdv = 1 + (fd90 - 1) * pow5(1 - von);
-					double fdl = 1 + (fd90 - 1) * pow5(1 - lon);
-        			vec3 kd = (1 - metalness) * fdv * fdl;
-					color albedo = base_color ? base_color->value(rec.tex_coord, rec.p) : color(0,0,0);
-        			vec3 diffuse = kd * albedo * lon / pi;
-
-        			// Combine diffuse and specular
-        			return vec3(1.) / ((1 - ratio_transmission) * ratio * (vec3(1.) + make_safe(specular / diffuse)));
-				};
+				scatter.sample_pdf = lambertian_pdf(n);
+				scatter.lobe = this;
+				scatter.lobe_id = diffuse_lobe;
+				scatter.lobe_scale = 1 / ((1 - ratio_transmission) * ratio);
+				scatter.normal = n, scatter.view = v;
+				scatter.weight = base_color ? base_color->value(rec.tex_coord, rec.p) : color(0,0,0);
 			}
 			else{// Direct sample specular to avoid singular D value;
 				scatter.using_importance_sampling=false;
-				auto ggx=make_shared<ggx_reflect_pdf>(n, v, roughness);
-				vec3 dir=ggx->sample();
+				ggx_reflect_pdf ggx(n, v, roughness);
+				vec3 dir=ggx.sample();
 				scatter.sample_ray=ray(rec.p,dir,ray_in.time());
-				scatter.attenuation = [=](const vec3 &l){
-					vec3 h = normalize(v + l);
-					double voh=dot(v,h), von=dot(v,n), lon=dot(l,n), hon=dot(h,n);
-					vec3 f = schlick_fresnel(voh);
-        			double g = geometry_smith(von) * geometry_smith(lon);
-        			vec3 specular = f * g * abs(voh) / (abs(von) * hon+ 1e-50);
-					return (max(make_safe(specular),0)) / ((1 - ratio_transmission) * (1 - ratio));
-				};
+				scatter.lobe = this;
+				scatter.lobe_id = specular_lobe;
+				scatter.lobe_scale = 1 / ((1 - ratio_transmission) * (1 - ratio));
+				scatter.normal = n, scatter.view = v;
 			}
 		}
         return true;
     }
 
+    color attenuation(const scatter_record& scatter, const vec3& l) const override {
+		vec3 n = scatter.normal, v = scatter.view;
+		vec3 h = normalize(v + l); // Half vector
+		double von=dot(v,n), lon=dot(l,n), voh=dot(v,h), hon=dot(h,n);
+		if(scatter.lobe_id == specular_lobe){
+			vec3 f = schlick_fresnel(voh);
+			double g = geometry_smith(von) * geometry_smith(lon);
+			vec3 specular = f * g * abs(voh) / (abs(von) * hon+ 1e-50);
+			return max(make_safe(specular),0) * scatter.lobe_scale;
+		}
+		if( von<=0 || lon<=0)return vec3(1,1,1);
+
+		// Specular term
+		vec3 f = schlick_fresnel(voh);
+		double g = geometry_smith(von) * geometry_smith(lon);
+		double d = distribution_ggx(hon);
+		vec3 specular = f * g * d / (4.0 * abs(von) + 1e-50);
+
+		// Diffuse term
+		double fd90 = 0.5 + 2 * roughness * square(voh);
+		double fdv = 1 + (fd90 - 1) * pow5(1 - von);
+		double fdl = 1 + (fd90 - 1) * pow5(1 - lon);
+		vec3 kd = (1 - metalness) * fdv * fdl;
+		vec3 diffuse = kd * scatter.weight * lon / pi;
+
+		// Combine diffuse and specular
+		return vec3(scatter.lobe_scale) / (vec3(1.) + make_safe(specular / diffuse));
+    }
+
     vec3 bsdf(const ray& ray_in, const hit_record& rec, const ray& ray_out) const override {
         vec3 n = normalize(rec.normal); // Surface normal
         vec3 v = -normalize(ray_in.direction()); // View vector
@@ -332,12 +350,20 @@ class PrincipledBSDF : public material {
         return max(make_safe(diffuse),0) + max(make_safe(specular),0);
     }
 
+    // Opacity is handled by alpha testing during traversal
+    bool alpha_tested() const override { return opacity_factor < 1; }
+    double opacity(const point2& tex_coord, const point3& p) const override { return opacity_factor; }
+
     color emit(const ray& ray_in, const hit_record& rec) const override {
         return emitted_intensity*(emitted ? emitted->value(rec.tex_coord, rec.p): color(0,0,0));
     }
+    color emission(const point2& tex_coord, const point3& p) const override {
+        return emitted_intensity*(emitted ? emitted->value(tex_coord, p): color(0,0,0));
+    }
 };
 
-
-
+inline color scatter_record::attenuation(const vec3& dir)const{
+	return lobe?lobe->attenuation(*this,dir):weight;
+}
 
 #endif
\ No newline at end of file
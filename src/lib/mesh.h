@@ -4,12 +4,11 @@
 #include "common.h"
 #include "bvh.h"
 #include "triangle.h"
+#include "alias_table.h"
 
 #include<vector>
-#include<unordered_map>
 
 using std::vector;
-using std::unordered_map;
 
 class mesh_vertex{
   public:
@@ -20,52 +19,183 @@ class mesh_vertex{
 		:position(position), normal(normal), tex_coord(tex_coord){}
 };
 
+// Indexed triangle mesh. Vertex attributes are kept in separate arrays and faces are stored in
+// the leaf order of the mesh's own BVH, so a leaf refers to faces by index and no per-triangle
+// objects exist; the face index of a hit is returned in hit_record::prim_id. As a light, the mesh
+// draws faces from an alias table weighted by area times emitted radiance.
 class mesh: public hittable{
   public:
 	mesh(const vector<mesh_vertex>& vertices, const vector<vec3i>& faces, const shared_ptr<material>& mat,
 		 bool using_vertex_normals=false)
-			:vertices(vertices), faces(faces), mat(mat), using_vertex_normals(using_vertex_normals){
+			:mat(mat), using_vertex_normals(using_vertex_normals){
 		num_faces=faces.size(),num_vertices=vertices.size();
-		hittable_list triangle_list;
-		boundingbox=bounding_box::empty;
-		for(int i=0;i<faces.size();i++){
-			auto T=faces[i];
-			point3 A=vertices[T.x].position,B=vertices[T.y].position,C=vertices[T.z].position;
-			auto new_triangle=make_shared<triangle>(A,B,C,mat);
-			triangle_id[new_triangle->get_pointer()]=i;
-			triangle_list.add(new_triangle);
+		for(auto& vertex:vertices){
+			positions.push_back(vertex.position);
+			tex_coords.push_back(vertex.tex_coord);
+			if(using_vertex_normals)normals.push_back(vertex.normal);
 		}
-		triangles=make_shared<bvh_node>(triangle_list);
-		boundingbox=triangles->bbox();
+		vector<bounding_box> boxes;
+		for(auto& T:faces)
+			boxes.push_back(bounding_box(bounding_box(positions[T.x],positions[T.y]),bounding_box(positions[T.z],positions[T.z])));
+		triangles.build(boxes);
+		for(int i:triangles.prim_order)this->faces.push_back(faces[i]);
+		cutout=mat&&mat->alpha_tested();
+		build_emitters();
 	}
 
 	bool hit(const ray& r, const interval& ray_t, hit_record& rec)const override{
-		if(!triangles->hit(r,ray_t,rec))return 0;
-		double v=rec.tex_coord.u, w=rec.tex_coord.v, u=1-v-w;
-		auto hit_triangle=faces[triangle_id.at(rec.obj)];
-		rec.tex_coord=u*vertices[hit_triangle.x].tex_coord
-					 +v*vertices[hit_triangle.y].tex_coord
-					 +w*vertices[hit_triangle.z].tex_coord;
+		triangle_ray tr(r);
+		bool hit_anything=triangles.hit(r,ray_t,rec,[&](int i,const ray& r,const interval& ray_t,hit_record& rec){
+			double t,b1,b2;
+			const vec3i& T=faces[i];
+			if(!intersect_triangle(tr,positions[T.x],positions[T.y],positions[T.z],ray_t,t,b1,b2)||!opaque_at(i,r,t,b1,b2))
+				return false;
+			rec.t=t,rec.prim_id=i,rec.uv=point2(b1,b2);
+			return true;
+		});
+		if(hit_anything)rec.obj=this;
+		return hit_anything;
+	}
+	void compute_surface_interaction(const ray& r, hit_record& rec)const override{
+		const vec3i& T=faces[rec.prim_id];
+		double v=rec.uv.u,w=rec.uv.v,u=1-v-w;
+		rec.p=r.at(rec.t);
+		rec.set_normal(r,face_normal(rec.prim_id));
+		rec.mat=mat.get();
+		rec.tex_coord=u*tex_coords[T.x]+v*tex_coords[T.y]+w*tex_coords[T.z];
 		if(using_vertex_normals)
-			rec.set_normal(r,normalize(u*vertices[hit_triangle.x].normal
-					  				   +v*vertices[hit_triangle.y].normal
-					  				   +w*vertices[hit_triangle.z].normal));
-		return 1;
+			rec.set_normal(r,normalize(u*normals[T.x]+v*normals[T.y]+w*normals[T.z]));
+	}
+	bool occluded(const ray& r, double t_max)const override{
+		triangle_ray tr(r);
+		interval ray_t(err,t_max);
+		double t,b1,b2;
+		occluder_cache& cache=last_occluder(occluder_id);
+		if(cache.owner==occluder_id){
+			const vec3i& T=faces[cache.prim];
+			if(intersect_triangle(tr,positions[T.x],positions[T.y],positions[T.z],ray_t,t,b1,b2)&&opaque_at(cache.prim,r,t,b1,b2))
+				return 1;
+		}
+		return triangles.any_hit(r,ray_t,[&](int i,const ray& r,const interval& ray_t){
+			const vec3i& T=faces[i];
+			if(!intersect_triangle(tr,positions[T.x],positions[T.y],positions[T.z],ray_t,t,b1,b2)||!opaque_at(i,r,t,b1,b2))
+				return false;
+			cache.owner=occluder_id,cache.prim=i;
+			return true;
+		});
+	}
+	int hit_packet(const ray_packet& packet, int active, interval ray_t[], hit_record rec[])const override{
+		triangle_ray tr[ray_packet::max_size];
+		for(int i=0;i<packet.size;i++)if(active>>i&1)tr[i]=triangle_ray(packet.rays[i]);
+		return triangles.hit_packet(packet,active,ray_t,rec,[&](int first,int count,int active,interval ray_t[],hit_record rec[]){
+			int mask=0;
+			for(int f=first;f<first+count;f++){
+				const vec3i& T=faces[f];
+				for(int i=0;i<packet.size;i++){
+					double t,b1,b2;
+					if(!(active>>i&1)||!intersect_triangle(tr[i],positions[T.x],positions[T.y],positions[T.z],ray_t[i],t,b1,b2)
+					   ||!opaque_at(f,packet.rays[i],t,b1,b2))continue;
+					rec[i].t=ray_t[i].max=t,rec[i].prim_id=f,rec[i].uv=point2(b1,b2),rec[i].obj=this,mask|=1<<i;
+				}
+			}
+			return mask;
+		});
+	}
+	bounding_box bbox()const override{ return triangles.bbox();}
+	// Every face the ray crosses could have produced its direction, so their densities add up.
+	double sample_pdf(const ray& r)const override{
+		double accum=0;
+		interval ray_t(err,infty);
+		hit_record rec;
+		while(hit(r,ray_t,rec)){
+			accum+=face_pdf(rec.prim_id,r,rec.t);
+			ray_t.min=std::nextafter(rec.t,infty);
+		}
+		return accum;
+	}
+	vec3 sample(const point3& origin,const double t)const override{
+		if(emitters.empty())return random_unit_vector();
+		const vec3i& T=faces[emitters.sample(random_double())];
+		double u=random_double(),v=random_double();
+		if(u+v>1)u=1-u,v=1-v;
+		point3 P=(1-u-v)*positions[T.x]+u*positions[T.y]+v*positions[T.z];
+		return normalize(P-origin);
+	}
+	const void* get_pointer()const override{return this;}
+	light_bounds emission_bounds()const override{
+		if(!num_faces)return light_bounds(bbox(),0);
+		vec3 w=face_normal(0);
+		double cos_theta_o=1;
+		for(int i=0;i<num_faces&&cos_theta_o>-1;i++)light_bounds::merge_cone(w,cos_theta_o,face_normal(i),1);
+		return light_bounds(bbox(),pi*emitted_power,w,cos_theta_o);
+	}
+	// Photons leave a face drawn from the alias table, at a uniform point of it.
+	bool sample_photon(double time, ray& r, color& power)const override{
+		if(emitters.empty()||!mat||mat->attenuated())return 0;
+		int i=emitters.sample(random_double());
+		const vec3i& T=faces[i];
+		double v=random_double(),w=random_double();
+		if(v+w>1)v=1-v,w=1-w;
+		point3 P=(1-v-w)*positions[T.x]+v*positions[T.y]+w*positions[T.z];
+		point2 tex_coord=(1-v-w)*tex_coords[T.x]+v*tex_coords[T.y]+w*tex_coords[T.z];
+		return diffuse_photon(P,face_normal(i),mat->emission(tex_coord,P),emitters.probability(i)/face_area(i),true,time,r,power);
 	}
-	bounding_box bbox()const override{ return boundingbox;}
-	double sample_pdf(const ray& r)const override{ return triangles->sample_pdf(r);}
-    vec3 sample(const point3& origin,const double t)const override{ return triangles->sample(origin,t);}
-    const void* get_pointer()const override{return this;}
 
   private:
 	bool using_vertex_normals;
 	int num_vertices,num_faces;
-	vector<mesh_vertex> vertices;
+	vector<point3> positions;
+	vector<vec3> normals;
+	vector<vec2> tex_coords;
 	vector<vec3i> faces;
-	shared_ptr<hittable> triangles;
-	unordered_map<const void*, int> triangle_id;
+	bvh_tree triangles;
 	shared_ptr<material> mat;
-	bounding_box boundingbox;
+	bool cutout;//material is alpha tested
+	uint64_t occluder_id=new_occluder_id();
+	alias_table emitters;//faces by area times emitted radiance
+	double emitted_power;//sum of area times luminance of the emitted radiance
+
+	// Weighs every face by its area times the luminance emitted at its centroid. Faces dark at the
+	// centroid keep a small weight, since a texture may still emit elsewhere on them; a mesh that
+	// emits nothing at all is sampled by area.
+	void build_emitters(){
+		vector<double> weights(num_faces),radiance(num_faces);
+		double max_radiance=0;
+		emitted_power=0;
+		for(int i=0;i<num_faces;i++){
+			const vec3i& T=faces[i];
+			point2 tex_coord=(tex_coords[T.x]+tex_coords[T.y]+tex_coords[T.z])/3;
+			point3 centroid=(positions[T.x]+positions[T.y]+positions[T.z])/3;
+			radiance[i]=mat?std::max(0.,luminance(mat->emission(tex_coord,centroid))):0;
+			max_radiance=std::max(max_radiance,radiance[i]);
+			emitted_power+=face_area(i)*radiance[i];
+		}
+		for(int i=0;i<num_faces;i++)
+			weights[i]=face_area(i)*(max_radiance>0?std::max(radiance[i],1e-3*max_radiance):1);
+		emitters=alias_table(weights);
+	}
+
+	bool opaque_at(int face, const ray& r, double t, double v, double w)const{
+		if(!cutout)return 1;
+		const vec3i& T=faces[face];
+		point2 tex_coord=(1-v-w)*tex_coords[T.x]+v*tex_coords[T.y]+w*tex_coords[T.z];
+		return alpha_test(mat->opacity(tex_coord,r.at(t)),r,t);
+	}
+
+	vec3 face_normal(int i)const{
+		const vec3i& T=faces[i];
+		return normalize(cross(positions[T.y]-positions[T.x],positions[T.z]-positions[T.x]));
+	}
+	double face_area(int i)const{
+		const vec3i& T=faces[i];
+		return length(cross(positions[T.y]-positions[T.x],positions[T.z]-positions[T.x]))/2;
+	}
+	// Solid angle density at which sample() produces the direction of r, through face i hit at t.
+	double face_pdf(int i, const ray& r, double t)const{
+		double dist_squared=t*t*r.direction().length_squared();
+		double cos_t=std::abs(dot(face_normal(i),normalize(r.direction())));
+		return emitters.probability(i)*dist_squared/(cos_t*face_area(i));
+	}
 };
 
 #endif
\ No newline at end of file
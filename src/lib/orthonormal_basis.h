@@ -13,6 +13,14 @@ class orthonormal_basis{
 		v=cross(w,u);
     }
 	orthonormal_basis(const vec3& u, const vec3& v, const vec3&w): u(u), v(v), w(w){}
+	// Basis around w chosen without random numbers (Duff et al., Building an Orthonormal Basis,
+	// Revisited, 2017), for samplers that must use a fixed number of dimensions.
+	static orthonormal_basis around(const vec3& direction){
+		vec3 w=normalize(direction);
+		double sign=std::copysign(1.,w.z());
+		double a=-1/(sign+w.z()),b=w.x()*w.y()*a;
+		return orthonormal_basis(vec3(1+sign*w.x()*w.x()*a,sign*b,-sign*w.x()),vec3(b,sign+w.y()*w.y()*a,-w.y()),w);
+	}
 
 	vec3 to_standard(const vec3& a)const{return a.x()*u+a.y()*v+a.z()*w;}
 	vec3 to_this(const vec3& a)const{return transpose(mat3(u,v,w))*a;}
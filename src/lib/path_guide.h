@@ -0,0 +1,233 @@
+#ifndef PATH_GUIDE_H
+#define PATH_GUIDE_H
+
+#include "common.h"
+#include "bounding_box.h"
+
+#include<atomic>
+#include<vector>
+
+// An atomic that can sit in a growing vector: copying it is a plain load and store, which is
+// enough between render passes, when nothing records.
+template<typename T>
+class copyable_atomic{
+  public:
+	copyable_atomic(T x=0): value(x){}
+	copyable_atomic(const copyable_atomic& other): value(other.load()){}
+	copyable_atomic& operator=(const copyable_atomic& other){
+		value.store(other.load(),std::memory_order_relaxed);
+		return *this;
+	}
+	T load()const{ return value.load(std::memory_order_relaxed);}
+	void add(T x){
+		T old=load();
+		while(!value.compare_exchange_weak(old,old+x,std::memory_order_relaxed));
+	}
+  private:
+	std::atomic<T> value;
+};
+
+// Distribution of incident light over the sphere of directions: a quadtree over the square of
+// cylindrical coordinates (cos theta, phi), which maps the sphere with equal area, so a cell's
+// density is its share of the energy over its share of the square. Recording adds energy to
+// the leaf under a direction without locks; build() then sums it up the tree for sampling.
+class direction_tree{
+  public:
+	direction_tree(): nodes(1){}
+
+	double total()const{ return total_energy;}
+	void record(const vec3& d, double energy){
+		point2 p=to_square(d);
+		int id=0;
+		while(1){
+			int i=quadrant(p);
+			if(!nodes[id].child[i]){
+				nodes[id].sum[i].add(energy);
+				return;
+			}
+			id=nodes[id].child[i];
+		}
+	}
+	// Solid angle density of d, for a unit vector d.
+	double pdf(const vec3& d)const{
+		if(!(total_energy>0))return 1/(4*pi);
+		point2 p=to_square(d);
+		double density=1;
+		int id=0;
+		while(1){
+			const node& cur=nodes[id];
+			double sum=cur.total();
+			if(!(sum>0))break;
+			int i=quadrant(p);
+			density*=4*cur.sum[i].load()/sum;
+			if(!cur.child[i])break;
+			id=cur.child[i];
+		}
+		return density/(4*pi);
+	}
+	vec3 sample()const{
+		point2 origin(0,0);
+		double size=1;
+		int id=0;
+		while(total_energy>0){
+			const node& cur=nodes[id];
+			double sum=cur.total(),u=random_double()*sum;
+			if(!(sum>0))break;
+			int i=0;
+			while(i<3&&u>=cur.sum[i].load())u-=cur.sum[i].load(),i++;
+			size/=2;
+			origin+=size*point2(i&1,i>>1);
+			if(!cur.child[i])break;
+			id=cur.child[i];
+		}
+		return to_sphere(origin+size*point2(random_double(),random_double()));
+	}
+
+	// Sums the recorded energy from the leaves up, so that every slot holds the energy below it.
+	void build(){
+		for(int id=nodes.size()-1;id>=0;id--)
+			for(int i=0;i<4;i++)
+				if(nodes[id].child[i])nodes[id].sum[i]=nodes[nodes[id].child[i]].total();
+		total_energy=nodes[0].total();
+	}
+	// Replaces this tree by an empty one shaped after the energy of built tree from: a cell is
+	// split while it holds more than threshold of the total, down to max_depth, so cells shrink
+	// where much light comes from and merge where little does.
+	void refine(const direction_tree& from, double threshold){
+		nodes.assign(1,node());
+		total_energy=0;
+		double total=from.total();
+		if(!(total>0))return;
+		struct entry{ int id,from_id,depth; double energy;};
+		std::vector<entry> stack{entry{0,0,1,total}};
+		while(!stack.empty()){
+			entry e=stack.back();
+			stack.pop_back();
+			for(int i=0;i<4;i++){
+				double energy=e.from_id>=0?from.nodes[e.from_id].sum[i].load():e.energy/4;
+				if(e.depth>=max_depth||energy/total<=threshold)continue;
+				int child=nodes.size();
+				nodes.push_back(node());
+				nodes[e.id].child[i]=child;
+				int from_child=e.from_id>=0&&from.nodes[e.from_id].child[i]?from.nodes[e.from_id].child[i]:-1;
+				stack.push_back(entry{child,from_child,e.depth+1,energy});
+			}
+		}
+	}
+
+  private:
+	struct node{
+		copyable_atomic<float> sum[4];//energy of the quadrants, ordered by (u>=1/2)+2*(v>=1/2)
+		int child[4]={0,0,0,0};//0 for a quadrant that is a leaf
+		double total()const{ return sum[0].load()+sum[1].load()+sum[2].load()+sum[3].load();}
+	};
+	static const int max_depth=20;
+	std::vector<node> nodes;
+	double total_energy=0;
+
+	// Quadrant of p, which moves into the quadrant's own unit square.
+	static int quadrant(point2& p){
+		int i=0;
+		if(p.u>=0.5)i|=1,p.u=2*p.u-1;
+		else p.u*=2;
+		if(p.v>=0.5)i|=2,p.v=2*p.v-1;
+		else p.v*=2;
+		return i;
+	}
+	static point2 to_square(const vec3& d){
+		double phi=atan2(d.y(),d.x());
+		if(phi<0)phi+=2*pi;
+		double u=(std::max(-1.,std::min(1.,d.z()))+1)/2,v=phi/(2*pi);
+		return point2(std::min(u,1-1e-9),std::min(v,1-1e-9));
+	}
+	static vec3 to_sphere(const point2& p){
+		double cos_theta=2*p.u-1,sin_theta=std::sqrt(std::max(0.,1-cos_theta*cos_theta)),phi=2*pi*p.v;
+		return vec3(sin_theta*cos(phi),sin_theta*sin(phi),cos_theta);
+	}
+};
+
+// Learned incident light for path guiding (Muller et al., Practical Path Guiding for Efficient
+// Light-Transport Simulation, 2017): a binary tree over space, halving its box along x, y and z
+// in turn, whose leaves each hold a direction_tree. A training pass samples directions from the
+// trees learned so far and records into a second set the radiance its paths bring back; refine()
+// then splits the leaves that many paths went through and reshapes every direction_tree after
+// what was recorded. Recording takes no locks, so all workers record into the same trees.
+class path_guide{
+  public:
+	path_guide(const bounding_box& box): box(box), leaves(1){}
+
+	// Distribution to draw directions from at p, null while nothing has been learned there.
+	const direction_tree* distribution(const point3& p)const{
+		const direction_tree& d=leaves[leaf_at(p)].sampling;
+		return d.total()>0?&d:nullptr;
+	}
+	// Records radiance that arrived at p from direction d, drawn with density pdf.
+	void record(const point3& p, const vec3& d, double radiance, double pdf){
+		leaf& l=leaves[leaf_at(p)];
+		l.samples.add(1);
+		if(radiance>0&&pdf>0)l.recording.record(normalize(d),radiance/pdf);
+	}
+	// Ends training pass k, of 2^k samples per pixel: leaves that took more than
+	// spatial_threshold*sqrt(2^k) samples split in two, then what every leaf recorded becomes its
+	// distribution and shapes an empty tree for the next pass.
+	void refine(int k){
+		double threshold=spatial_threshold*std::sqrt(double(1<<k));
+		for(size_t id=0;id<nodes.size();id++){
+			if(nodes[id].leaf<0||nodes[id].depth>=max_depth||leaves[nodes[id].leaf].samples.load()<=threshold)continue;
+			int first=nodes.size(),from=nodes[id].leaf;
+			leaves[from].samples=leaves[from].samples.load()/2;
+			leaves.push_back(leaves[from]);
+			nodes.push_back(node{0,from,nodes[id].depth+1});
+			nodes.push_back(node{0,int(leaves.size())-1,nodes[id].depth+1});
+			nodes[id].child=first,nodes[id].leaf=-1;
+		}
+		for(leaf& l:leaves){
+			l.recording.build();
+			l.sampling=l.recording;
+			l.recording.refine(l.sampling,directional_threshold);
+			l.samples=0;
+		}
+	}
+
+  private:
+	struct node{
+		int child;//first of two, the second follows it
+		int leaf;//-1 above the leaves
+		int depth;
+	};
+	struct leaf{
+		direction_tree sampling,recording;
+		copyable_atomic<int> samples;
+	};
+	static constexpr double spatial_threshold=12000,directional_threshold=0.01;
+	static const int max_depth=60;
+	bounding_box box;
+	std::vector<node> nodes{node{0,0,0}};
+	std::vector<leaf> leaves;
+
+	int leaf_at(const point3& p)const{
+		double x[3]={relative(p.x(),box.x),relative(p.y(),box.y),relative(p.z(),box.z)};
+		int id=0;
+		while(nodes[id].leaf<0){
+			double& c=x[nodes[id].depth%3];
+			if(c<0.5)c*=2,id=nodes[id].child;
+			else c=2*c-1,id=nodes[id].child+1;
+		}
+		return nodes[id].leaf;
+	}
+	static double relative(double c, const interval& range){
+		return range.size()>0?std::max(0.,std::min(1.,(c-range.min)/range.size())):0;
+	}
+};
+
+// Directions drawn from a direction_tree, as a pdf for mixed_pdf.
+class guided_pdf{
+  public:
+	guided_pdf(const direction_tree* tree=nullptr): tree(tree){}
+	double value(const vec3& v)const{ return tree?tree->pdf(normalize(v)):0;}
+	vec3 sample()const{ return tree->sample();}
+  private:
+	const direction_tree* tree;
+};
+
+#endif
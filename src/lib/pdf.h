@@ -3,57 +3,57 @@
 
 #include "common.h"
 #include "hittable.h"
+#include<variant>
 
-class pdf{
-  public:
-	virtual ~pdf(){}
-	virtual double value(const vec3& v)const=0;
-	virtual vec3 sample()const=0;
-};
+// The pdfs below are plain value types; class pdf at the end of this file holds any one of them
+// inline, so building and copying a pdf on every bounce never touches the heap.
 
-class uniform_pdf: public pdf{
+class uniform_pdf{
   public:
 	uniform_pdf(){}
-	double value(const vec3& v)const override{return 1/(4*pi);}
-	vec3 sample()const override{return random_unit_vector();}
+	double value(const vec3& v)const{return 1/(4*pi);}
+	vec3 sample()const{return random_unit_vector();}
 };
 
-class lambertian_pdf: public pdf{
+class lambertian_pdf{
   public:
 	lambertian_pdf(const vec3& norm): B(norm){}
-	double value(const vec3& v)const override{return std::max(1e-12,dot(B.w,normalize(v))/pi);}
-	vec3 sample()const override{return B.to_standard(random_lambertian_direction());}
+	double value(const vec3& v)const{return std::max(1e-12,dot(B.w,normalize(v))/pi);}
+	vec3 sample()const{return B.to_standard(random_lambertian_direction());}
   private:
 	orthonormal_basis B;
 };
 
-class directed_pdf: public pdf{
+class directed_pdf{
   public:
-	directed_pdf(const shared_ptr<hittable> object, const point3& origin):
+	directed_pdf(const hittable* object, const point3& origin):
 		object(object), origin(origin){};
-	double value(const vec3& v)const override{return object->sample_pdf(ray(origin,v));}
-	vec3 sample()const override{return object->sample(origin);}
+	double value(const vec3& v)const{return object->sample_pdf(ray(origin,v));}
+	vec3 sample()const{return object->sample(origin);}
   private:
-	const shared_ptr<hittable> object;
+	const hittable* object;
 	point3 origin;
 };
 
-class mixed_pdf: public pdf{
+template<typename P0, typename P1>
+class mixed_pdf{
   public:
-	mixed_pdf(const shared_ptr<pdf>& p0, const shared_ptr<pdf>& p1,const double lambda): 
+	mixed_pdf(const P0& p0, const P1& p1,const double lambda): 
 		p0(p0), p1(p1), lambda(lambda){};
-	double value(const vec3& v)const override{
-		return lambda*p0->value(v)+(1-lambda)*p1->value(v);
+	double value(const vec3& v)const{
+		return lambda*p0.value(v)+(1-lambda)*p1.value(v);
 	}
-	vec3 sample()const override{
-		return (random_double()<lambda?p0:p1)->sample();
+	vec3 sample()const{
+		if(lambda<=0)return p1.sample();
+		return random_double()<lambda?p0.sample():p1.sample();
 	}
   private:
-	shared_ptr<pdf> p0,p1;
+	P0 p0;
+	P1 p1;
 	double lambda;
 };
 
-class ggx_reflect_pdf : public pdf {
+class ggx_reflect_pdf {
   private:
 	orthonormal_basis onb; // Surface normal
 	vec3 v; // View vector
@@ -77,12 +77,12 @@ class ggx_reflect_pdf : public pdf {
 	ggx_reflect_pdf(const vec3& normal, const vec3& view_dir, double roughness)
 		: onb(normal), v(normalize(view_dir)), alpha(roughness * roughness) {}
 
-	double value(const vec3& l) const override{
+	double value(const vec3& l) const{
 		// return std::max(1e-12,dot(onb.w,normalize(l))/pi);
 		return value0(l)+value0(-l);
 	}
 
-	vec3 sample() const override {
+	vec3 sample() const {
 		// return onb.to_standard(random_lambertian_direction());
 		// Importance sample GGX distribution for the half-vector
 		double u1 = random_double();
@@ -104,5 +104,22 @@ class ggx_reflect_pdf : public pdf {
 	}
 };
 
+using lambertian_ggx_pdf=mixed_pdf<lambertian_pdf,ggx_reflect_pdf>;
+
+// A sampling density held by value as a tagged union of the pdfs above.
+class pdf{
+  public:
+	pdf(){}
+	pdf(const uniform_pdf& p): p(p){}
+	pdf(const lambertian_pdf& p): p(p){}
+	pdf(const directed_pdf& p): p(p){}
+	pdf(const ggx_reflect_pdf& p): p(p){}
+	pdf(const lambertian_ggx_pdf& p): p(p){}
+	double value(const vec3& v)const{ return std::visit([&](const auto& p){ return p.value(v);},p);}
+	vec3 sample()const{ return std::visit([](const auto& p){ return p.sample();},p);}
+  private:
+	std::variant<uniform_pdf,lambertian_pdf,directed_pdf,ggx_reflect_pdf,lambertian_ggx_pdf> p;
+};
+
 
 #endif
\ No newline at end of file
@@ -3,7 +3,6 @@
 
 #include "common.h"
 #include<algorithm>
-#include<random>
 
 class perlin_noise{
   public:
@@ -34,7 +33,7 @@ class perlin_noise{
     int px[size],py[size],pz[size];
     static void rand_perm(int *p){
         for(int i=0;i<size;i++)p[i]=i;
-        std::shuffle(p,p+size,std::default_random_engine(rand()));
+        for(int i=size-1;i>0;i--)std::swap(p[i],p[random_int(i+1)]);
     }
     static double fade(double x){return x*x*x*((6*x-15)*x+10);}
 };
@@ -0,0 +1,68 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "common.h"
+
+#include<vector>
+
+// Photons left on surfaces, for density estimation within a fixed radius. The photons are sorted
+// by the cell of a grid as wide as the radius, the cells hashed into a table of ranges, so a query
+// visits the photons of the 27 cells around its point.
+class photon_map{
+  public:
+	struct photon{
+		point3 p;
+		vec3 direction;//of travel, unit length
+		color power;
+	};
+
+	photon_map(const std::vector<photon>& stored, double radius): gather_radius(radius){
+		int table_size=1;
+		while(table_size<2*(int)stored.size())table_size*=2;
+		mask=table_size-1;
+		//counting sort by the cell's slot in the table
+		start.assign(table_size+1,0);
+		std::vector<int> slots(stored.size());
+		for(size_t i=0;i<stored.size();i++)start[(slots[i]=slot(cell_of(stored[i].p)))+1]++;
+		for(int s=0;s<table_size;s++)start[s+1]+=start[s];
+		std::vector<int> next(start.begin(),start.end()-1);
+		photons.resize(stored.size());
+		for(size_t i=0;i<stored.size();i++)photons[next[slots[i]]++]=stored[i];
+	}
+
+	double radius()const{ return gather_radius;}
+	size_t size()const{ return photons.size();}
+	// Calls f(photon) for every photon within the radius of p.
+	template<typename F>
+	void gather(const point3& p, F&& f)const{
+		vec3i c=cell_of(p);
+		double r2=gather_radius*gather_radius;
+		for(int dx=-1;dx<=1;dx++)
+			for(int dy=-1;dy<=1;dy++)
+				for(int dz=-1;dz<=1;dz++){
+					vec3i neighbour(c.x+dx,c.y+dy,c.z+dz);
+					int s=slot(neighbour);
+					for(int i=start[s];i<start[s+1];i++)
+						//other cells may share the slot
+						if((photons[i].p-p).length_squared()<=r2&&same_cell(cell_of(photons[i].p),neighbour))f(photons[i]);
+				}
+	}
+
+  private:
+	double gather_radius;
+	int mask;
+	std::vector<int> start;//photons of slot s are [start[s],start[s+1])
+	std::vector<photon> photons;
+
+	vec3i cell_of(const point3& p)const{
+		return vec3i(std::floor(p.x()/gather_radius),std::floor(p.y()/gather_radius),std::floor(p.z()/gather_radius));
+	}
+	static bool same_cell(const vec3i& a, const vec3i& b){ return a.x==b.x&&a.y==b.y&&a.z==b.z;}
+	int slot(const vec3i& c)const{
+		uint64_t h=mix_bits(uint64_t(uint32_t(c.x)));
+		h=mix_bits(h^uint64_t(uint32_t(c.y)));
+		return mix_bits(h^uint64_t(uint32_t(c.z)))&mask;
+	}
+};
+
+#endif
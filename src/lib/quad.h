@@ -2,6 +2,7 @@
 #define QUAD_H
 
 #include "hittable.h"
+#include "material.h"
 #include "common.h"
 #include "mat3.h"
 
@@ -12,42 +13,127 @@ class quad: public hittable{
         boundingbox=bounding_box(bounding_box(Q,Q+u+v),bounding_box(Q+u,Q+v));
         normal=normalize(cross(u,v));
         area=length(cross(u,v));
+        w_plane=cross(u,v)/dot(cross(u,v),cross(u,v));
+        rectangular=std::abs(dot(u,v))<1e-9*length(u)*length(v);
+        cutout=mat&&mat->alpha_tested();
     }
     const void* get_pointer()const override{return this;}
     vec3 norm(){return normal;}
     bool hit(const ray& r, const interval& ray_t, hit_record& rec)const override{
-        mat3 A(-r.direction(),u,v);
-        vec3 b=r.origin()-Q;
-        if(abs(det(A))<err)return 0;
-        vec3 v=inv(A)*b;
-        if(!interval::ratio.contains(v[1])||!interval::ratio.contains(v[2])||!ray_t.contains(v[0]))return 0;
+        vec3 v;
+        if(!intersect(r,ray_t,v))return 0;
         rec.t=v[0];
+        rec.uv=point2(v[1],v[2]);
+        rec.obj=this;
+        return 1;
+    }
+    void compute_surface_interaction(const ray& r, hit_record& rec)const override{
         rec.p=r.at(rec.t);
         rec.set_normal(r,normal);
-        rec.mat=mat;
-        rec.tex_coord=point2(v[1],v[2]);
-        rec.obj=get_pointer();
-        return 1;
+        rec.mat=mat.get();
+        rec.tex_coord=rec.uv;
+    }
+    bool occluded(const ray& r, double t_max)const override{
+        vec3 v;
+        return intersect(r,interval(err,t_max),v);
     }
     bounding_box bbox()const override{ return boundingbox;}
+    // Rectangles are sampled uniformly in the solid angle they subtend; parallelograms, and
+    // rectangles seen under a tiny or nearly full solid angle, uniformly by area.
     double sample_pdf(const ray& r)const override{
-        hit_record rec;
-        if(!hit(r,interval(err,infty),rec))return 0;
-        double dist_squared=rec.t*rec.t*r.direction().length_squared();
-        double cos_t=abs(dot(rec.normal,normalize(r.direction())));
+        double t;
+        if(!crosses(r,t))return 0;
+        spherical_rectangle rect;
+        if(spherical(r.origin(),rect))return 1/rect.solid_angle;
+        double dist_squared=t*t*r.direction().length_squared();
+        double cos_t=abs(dot(normal,normalize(r.direction())));
         return dist_squared/(cos_t*area);
     }
     vec3 sample(const point3& origin,const double t)const override{
-        point3 P=Q+random_double()*u+random_double()*v;
+        spherical_rectangle rect;
+        double s=random_double(),w=random_double();
+        if(spherical(origin,rect))return normalize(rect.sample(s,w)-origin);
+        point3 P=Q+s*u+w*v;
         return normalize(P-origin);
     }
+    light_bounds emission_bounds()const override{
+        return light_bounds(boundingbox,pi*area*luminance(mat->mean_emission()),normal,1);
+    }
+    // Photons leave a uniform point of the quad, from either side as emit() shines both ways.
+    bool sample_photon(double time, ray& r, color& power)const override{
+        if(mat->attenuated())return 0;
+        double s=random_double(),t=random_double();
+        point3 P=Q+s*u+t*v;
+        return diffuse_photon(P,normal,mat->emission(point2(s,t),P),1/area,true,time,r,power);
+    }
   private:
+    // Rectangle as seen from a point, set up for uniform solid angle sampling (Urena, Fajardo and
+    // King, An Area-Preserving Parametrization for Spherical Rectangles, 2013). Coordinates are
+    // in the frame of the rectangle's edges, with the point at the origin and the rectangle at z0<0.
+    struct spherical_rectangle{
+        point3 o;
+        vec3 ex,ey,ez;
+        double x0,x1,y0,y1,z0;
+        double b0,b1,k,solid_angle;
+        point3 sample(double s, double t)const{
+            double au=s*solid_angle+k;
+            double fu=(cos(au)*b0-b1)/sin(au);
+            double cu=std::max(-1.,std::min(1.,std::copysign(1.,fu)/std::sqrt(fu*fu+b0*b0)));
+            double xu=std::max(x0,std::min(x1,-cu*z0/std::sqrt(std::max(1e-12,1-cu*cu))));
+            double d=std::sqrt(xu*xu+z0*z0);
+            double h0=y0/std::sqrt(d*d+y0*y0),h1=y1/std::sqrt(d*d+y1*y1);
+            double hv=h0+t*(h1-h0),hv2=hv*hv;
+            double yv=hv2<1-1e-12?hv*d/std::sqrt(1-hv2):y1;
+            return o+xu*ex+yv*ey+z0*ez;
+        }
+    };
+    // Sets up rect for origin; false when solid angle sampling does not apply.
+    bool spherical(const point3& origin, spherical_rectangle& rect)const{
+        if(!rectangular)return 0;
+        double len_u=length(u),len_v=length(v);
+        rect.o=origin,rect.ex=u/len_u,rect.ey=v/len_v,rect.ez=normal;
+        vec3 d=Q-origin;
+        rect.x0=dot(d,rect.ex),rect.y0=dot(d,rect.ey),rect.z0=dot(d,rect.ez);
+        if(rect.z0>0)rect.z0=-rect.z0,rect.ez=-rect.ez;
+        if(rect.z0>-1e-9*(len_u+len_v))return 0;
+        rect.x1=rect.x0+len_u,rect.y1=rect.y0+len_v;
+        vec3 v00(rect.x0,rect.y0,rect.z0),v01(rect.x0,rect.y1,rect.z0);
+        vec3 v10(rect.x1,rect.y0,rect.z0),v11(rect.x1,rect.y1,rect.z0);
+        vec3 n0=normalize(cross(v00,v10)),n1=normalize(cross(v10,v11));
+        vec3 n2=normalize(cross(v11,v01)),n3=normalize(cross(v01,v00));
+        double g0=acos(-dot(n0,n1)),g1=acos(-dot(n1,n2)),g2=acos(-dot(n2,n3)),g3=acos(-dot(n3,n0));
+        rect.b0=n0.z(),rect.b1=n2.z();
+        rect.k=2*pi-g2-g3;
+        rect.solid_angle=g0+g1-rect.k;
+        return rect.solid_angle>3e-4&&rect.solid_angle<6.2;
+    }
+    // Whether r crosses the quad's plane inside the quad, and where; ignores cut-outs.
+    bool crosses(const ray& r, double& t)const{
+        double denom=dot(normal,r.direction());
+        if(std::abs(denom)<1e-12)return 0;
+        t=dot(Q-r.origin(),normal)/denom;
+        if(t<=err)return 0;
+        vec3 p=r.at(t)-Q;
+        return interval::ratio.contains(dot(w_plane,cross(p,v)))&&interval::ratio.contains(dot(w_plane,cross(u,p)));
+    }
+    // (t,u,v) of the point where r crosses the quad, if it does inside ray_t.
+    bool intersect(const ray& r, const interval& ray_t, vec3& tuv)const{
+        mat3 A(-r.direction(),u,v);
+        vec3 b=r.origin()-Q;
+        if(abs(det(A))<err)return 0;
+        tuv=inv(A)*b;
+        if(!interval::ratio.contains(tuv[1])||!interval::ratio.contains(tuv[2])||!ray_t.contains(tuv[0]))return 0;
+        return !cutout||alpha_test(mat->opacity(point2(tuv[1],tuv[2]),r.at(tuv[0])),r,tuv[0]);
+    }
     point3 Q;
     vec3 u,v;
     vec3 normal;
+    vec3 w_plane;//cross(u,v)/|cross(u,v)|^2, for the plane coordinates of a point
+    bool rectangular;
     shared_ptr<material> mat;
     bounding_box boundingbox;
     double area;
+    bool cutout;//material is alpha tested
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+#ifndef RADIANCE_CACHE_H
+#define RADIANCE_CACHE_H
+
+#include "common.h"
+
+#include<atomic>
+#include<memory>
+
+// Radiance reflected off surfaces, averaged over the cells of a world-space grid (Binder et al.,
+// Fast Path Space Filtering by Jittered Spatial Hashing, 2018). A cell spans cell_scale pixel
+// footprints at its distance from the eye, rounded up to a power of two, so far cells are coarse
+// and near ones fine. Cells are found by hashing their level, coordinates and the normal's
+// dominant axis into a fixed table with linear probing. Positions are jittered by up to a cell,
+// which turns the grid's blocks into noise. Slots are claimed and summed with atomics, so all
+// workers add to and read the table without locks.
+class radiance_cache{
+  public:
+	radiance_cache(const point3& eye, double pixel_angle, double cell_scale, int size_log2=20):
+		eye(eye), footprint(pixel_angle*cell_scale), mask((uint64_t(1)<<size_log2)-1),
+		entries(new entry[mask+1]()){}
+
+	void add(const point3& p, const vec3& normal, const color& radiance){
+		entry* e=find(key(p,normal),true);
+		if(!e)return;
+		for(int c=0;c<3;c++)atomic_add(e->sum[c],radiance[c]);
+		e->count.fetch_add(1,std::memory_order_relaxed);
+	}
+	// Mean radiance of the cell around p, if it has enough samples to stand in for a path.
+	bool lookup(const point3& p, const vec3& normal, color& radiance)const{
+		const entry* e=find(key(p,normal),false);
+		if(!e)return 0;
+		uint32_t count=e->count.load(std::memory_order_relaxed);
+		if(count<min_samples)return 0;
+		for(int c=0;c<3;c++)radiance[c]=e->sum[c].load(std::memory_order_relaxed)/count;
+		return 1;
+	}
+
+  private:
+	struct entry{
+		std::atomic<uint64_t> key;//0 while free
+		std::atomic<float> sum[3];
+		std::atomic<uint32_t> count;
+	};
+	static const int max_probes=8;
+	static const uint32_t min_samples=8;
+	point3 eye;
+	double footprint;//cell size per unit of distance from the eye
+	uint64_t mask;
+	std::unique_ptr<entry[]> entries;
+
+	uint64_t key(const point3& p, const vec3& normal)const{
+		int level=std::ceil(std::log2(std::max(1e-30,footprint*length(p-eye))));
+		double size=std::ldexp(1.,level);
+		uint64_t h=mix_bits(uint64_t(level+1024));
+		for(int c=0;c<3;c++){
+			double x=p[c]+(random_generator().next_double()-0.5)*size;
+			h=mix_bits(h^uint64_t(int64_t(std::floor(x/size))));
+		}
+		double n[3]={std::fabs(normal.x()),std::fabs(normal.y()),std::fabs(normal.z())};
+		int axis=n[0]>=n[1]?(n[0]>=n[2]?0:2):(n[1]>=n[2]?1:2);
+		return mix_bits(h^uint64_t(2*axis+(normal[axis]<0)))|1;
+	}
+	entry* find(uint64_t k, bool insert)const{
+		for(int i=0;i<max_probes;i++){
+			entry& e=entries[(k+i)&mask];
+			uint64_t cur=e.key.load(std::memory_order_relaxed);
+			if(cur==k)return &e;
+			if(cur)continue;
+			if(!insert)return nullptr;
+			if(e.key.compare_exchange_strong(cur,k,std::memory_order_relaxed)||cur==k)return &e;
+		}
+		return nullptr;
+	}
+	static void atomic_add(std::atomic<float>& x, float y){
+		float old=x.load(std::memory_order_relaxed);
+		while(!x.compare_exchange_weak(old,old+y,std::memory_order_relaxed));
+	}
+};
+
+#endif
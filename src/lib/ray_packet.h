@@ -0,0 +1,19 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "ray.h"
+
+// A bundle of coherent rays (e.g. the camera samples of one pixel) traced through the scene
+// together. Which rays take part in a query is given by a bit mask next to the packet.
+class ray_packet{
+  public:
+	static constexpr int max_size=16;
+	int size=0;
+	ray rays[max_size];
+
+	inline void clear(){ size=0;}
+	inline void add(const ray& r){ rays[size++]=r;}
+	inline int all()const{ return (1<<size)-1;}
+};
+
+#endif
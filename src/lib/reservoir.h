@@ -0,0 +1,41 @@
+#ifndef RESERVOIR_H
+#define RESERVOIR_H
+
+// Weighted reservoir sampling of one sample out of a stream of candidates, the building block of
+// resampled importance sampling (Bitterli et al., Spatiotemporal Reservoir Resampling for
+// Real-Time Ray Tracing with Dynamic Direct Lighting, 2020). A candidate with resampling weight w
+// replaces the kept sample with probability w/weight_sum, so the kept sample ends up picked in
+// proportion to its weight while the reservoir holds only one.
+template<typename T>
+class reservoir{
+  public:
+	T sample;
+	double target=0;//target function at sample
+	double weight_sum=0;
+	int count=0;//candidates seen, M
+
+	// Offers candidate x with target function x_target and resampling weight w, for u in [0,1).
+	bool update(const T& x, double x_target, double w, double u){
+		count++;
+		return add(x,x_target,w,u);
+	}
+	// Merges a reservoir built for another target function: x is its sample as seen by this one
+	// and x_target this reservoir's target function there.
+	bool merge(const reservoir& r, const T& x, double x_target, double u){
+		count+=r.count;
+		return add(x,x_target,x_target*r.contribution_weight()*r.count,u);
+	}
+	// Unbiased contribution weight W of the sample, which stands in for 1/pdf.
+	double contribution_weight()const{ return target>0?weight_sum/(count*target):0;}
+
+  private:
+	bool add(const T& x, double x_target, double w, double u){
+		if(!(w>0))return 0;
+		weight_sum+=w;
+		if(u*weight_sum>=w)return 0;
+		sample=x,target=x_target;
+		return 1;
+	}
+};
+
+#endif
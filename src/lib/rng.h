@@ -0,0 +1,50 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include<cstdint>
+
+// PCG32 (O'Neill 2014): a 64-bit LCG with a permuted 32-bit output. The stream selects one of
+// 2^63 independent sequences, so (seed, stream) pairs can be handed out per pixel and sample.
+class pcg32{
+  public:
+	pcg32(uint64_t seed=0x853c49e6748fea9bull, uint64_t stream=0xda3e39cb94b95bdbull){ set_seed(seed,stream);}
+
+	void set_seed(uint64_t seed, uint64_t stream=0xda3e39cb94b95bdbull){
+		state=0,inc=stream<<1|1;
+		next_uint();
+		state+=seed;
+		next_uint();
+	}
+	uint32_t next_uint(){
+		uint64_t old=state;
+		state=old*6364136223846793005ull+inc;
+		uint32_t xorshifted=((old>>18)^old)>>27;
+		uint32_t rot=old>>59;
+		return (xorshifted>>rot)|(xorshifted<<((~rot+1)&31));
+	}
+	// Uniform in [0,1).
+	double next_double(){ return next_uint()*(1./4294967296.);}
+	// Uniform in [0,n), without the modulo bias of next_uint()%n: the high half of a 32x32 bit
+	// product, redrawn when the low half lands among the 2^32 mod n values that would favour some
+	// results (Lemire, Fast Random Integer Generation in an Interval, 2019).
+	uint32_t next_uint(uint32_t n){
+		uint64_t m=uint64_t(next_uint())*n;
+		if(uint32_t(m)<n){
+			uint32_t threshold=(0u-n)%n;
+			while(uint32_t(m)<threshold)m=uint64_t(next_uint())*n;
+		}
+		return uint32_t(m>>32);
+	}
+
+  private:
+	uint64_t state,inc;
+};
+
+// SplitMix64 finalizer, used to turn structured keys (pixel index, seed) into well-spread seeds.
+inline uint64_t mix_bits(uint64_t x){
+	x^=x>>30;x*=0xbf58476d1ce4e5b9ull;
+	x^=x>>27;x*=0x94d049bb133111ebull;
+	return x^(x>>31);
+}
+
+#endif
@@ -120,6 +120,18 @@ class rtw_image {
 		return bdata + y*bytes_per_scanline + x*bytes_per_pixel;
 	}
 
+	const float* linear_pixel_data(int x, int y) const {
+		// Return the address of the three linear floating-point values of the pixel at x,y, with
+		// the full range of an HDR file. Only images loaded from a file have them; otherwise
+		// returns nullptr.
+		if (fdata == nullptr) return nullptr;
+
+		x = clamp(x, 0, image_width);
+		y = clamp(y, 0, image_height);
+
+		return fdata + y*bytes_per_scanline + x*bytes_per_pixel;
+	}
+
   private:
 	bool 		   load_success	   = 0;
 	const int      bytes_per_pixel = 3;
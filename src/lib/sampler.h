@@ -0,0 +1,185 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "common.h"
+#include<vector>
+
+// Sample generators for the camera. A sampler is started on one sample of one pixel and then
+// hands out the dimensions of that sample in order: the camera takes the pixel position, lens
+// and time first, and every random_double() along the path takes the next one. Each worker
+// owns a clone, so implementations may keep per-sample state.
+class sampler: public sample_source{
+  public:
+	virtual std::unique_ptr<sampler> clone()const=0;
+
+	// Starts sample `index` of the `spp` samples of pixel (x,y), at dimension 0.
+	void start_pixel_sample(int x, int y, int index, int spp){
+		px=x,py=y,sample_index=index,num_samples=spp,dim=0;
+	}
+	int dimension()const{ return dim;}
+	void set_dimension(int d){ dim=d;}
+
+	double next_1d()override{ return sample_1d(dim++);}
+	point2 next_2d(){
+		point2 u=sample_2d(dim);
+		dim+=2;
+		return u;
+	}
+
+  protected:
+	int px=0,py=0,sample_index=0,num_samples=1,dim=0;
+
+	virtual double sample_1d(int d)=0;
+	virtual point2 sample_2d(int d){
+		double u=sample_1d(d);
+		return point2(u,sample_1d(d+1));
+	}
+	// Seed of dimension d, the same for every sample of a pixel and different across pixels.
+	uint32_t pixel_seed(int d)const{
+		return mix_bits(random_seed()^mix_bits((uint64_t(uint32_t(py))<<32|uint32_t(px))^mix_bits(d+1)));
+	}
+	static double to_unit(uint32_t x){ return x*(1./4294967296.);}
+	static uint32_t hash(uint32_t x, uint32_t key){ return mix_bits(uint64_t(key)<<32|x);}
+};
+
+// Independent uniform samples from the thread's generator.
+class independent_sampler: public sampler{
+  public:
+	std::unique_ptr<sampler> clone()const override{ return std::make_unique<independent_sampler>(*this);}
+  protected:
+	double sample_1d(int d)override{ return random_generator().next_double();}
+};
+
+// Stratifies every dimension on its own: in each pixel the spp samples take one stratum each of
+// [0,1), in an order that is a different random permutation per dimension (a padded Latin
+// hypercube), and are jittered inside it.
+class stratified_sampler: public sampler{
+  public:
+	std::unique_ptr<sampler> clone()const override{ return std::make_unique<stratified_sampler>(*this);}
+  protected:
+	double sample_1d(int d)override{
+		uint32_t stratum=permute_index(sample_index%num_samples,num_samples,pixel_seed(d));
+		return (stratum+random_generator().next_double())/num_samples;
+	}
+  private:
+	// Kensler's hash-based permutation of [0,n), selected by seed (Correlated Multi-Jittered
+	// Sampling, 2013).
+	static uint32_t permute_index(uint32_t i, uint32_t n, uint32_t seed){
+		uint32_t w=n-1;
+		w|=w>>1,w|=w>>2,w|=w>>4,w|=w>>8,w|=w>>16;
+		do{
+			i^=seed;i*=0xe170893d;i^=seed>>16;
+			i^=(i&w)>>4;i^=seed>>8;i*=0x0929eb3f;i^=seed>>23;
+			i^=(i&w)>>1;i*=1|seed>>27;i*=0x6935fa69;
+			i^=(i&w)>>11;i*=0x74dcb303;
+			i^=(i&w)>>2;i*=0x9e501cc3;
+			i^=(i&w)>>2;i*=0xc860a3df;
+			i&=w;i^=i>>5;
+		}while(i>=n);
+		return (i+seed)%n;
+	}
+};
+
+// Owen-scrambled Sobol points with Burley's hash-based scrambling (Practical Hash-based Owen
+// Scrambling, 2020). Every 1D or 2D request draws from the first one or two Sobol dimensions,
+// with the sample order shuffled and the values scrambled by seeds of its own. Prefixes of
+// 2^k samples of a pixel are stratified in every dimension and every 2D pair.
+class sobol_sampler: public sampler{
+  public:
+	std::unique_ptr<sampler> clone()const override{ return std::make_unique<sobol_sampler>(*this);}
+  protected:
+	double sample_1d(int d)override{
+		uint32_t seed=dimension_seed(d);
+		uint32_t index=nested_uniform_scramble(sample_index,hash(seed,0));
+		return to_unit(nested_uniform_scramble(reverse_bits(index),hash(seed,1)));
+	}
+	point2 sample_2d(int d)override{
+		uint32_t seed=dimension_seed(d);
+		uint32_t index=nested_uniform_scramble(sample_index,hash(seed,0));
+		return point2(to_unit(nested_uniform_scramble(reverse_bits(index),hash(seed,1))),
+					  to_unit(nested_uniform_scramble(sobol_1(index),hash(seed,2))));
+	}
+	virtual uint32_t dimension_seed(int d)const{ return pixel_seed(d);}
+
+	static uint32_t reverse_bits(uint32_t x){
+		x=(x<<16)|(x>>16);
+		x=((x&0x00ff00ff)<<8)|((x&0xff00ff00)>>8);
+		x=((x&0x0f0f0f0f)<<4)|((x&0xf0f0f0f0)>>4);
+		x=((x&0x33333333)<<2)|((x&0xcccccccc)>>2);
+		x=((x&0x55555555)<<1)|((x&0xaaaaaaaa)>>1);
+		return x;
+	}
+	// Second Sobol dimension; the first is the bit reversal of the index.
+	static uint32_t sobol_1(uint32_t index){
+		uint32_t v=1u<<31,x=0;
+		for(;index;index>>=1,v^=v>>1)
+			if(index&1)x^=v;
+		return x;
+	}
+	static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed){
+		x+=seed;
+		x^=x*0x6c50b47cu;
+		x^=x*0xb82f1e52u;
+		x^=x*0xc7afe638u;
+		x^=x*0x8d22f6e6u;
+		return x;
+	}
+	static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed){
+		return reverse_bits(laine_karras_permutation(reverse_bits(x),seed));
+	}
+};
+
+// Screen-space blue noise (Georgiev and Fajardo, Blue-noise Dithered Sampling, 2016): every pixel
+// uses the same scrambled Sobol points, toroidally shifted by a value read from a blue-noise
+// mask, so neighbouring pixels get decorrelated samples and the remaining error is spread as
+// high-frequency noise. The mask is read at a different offset for every dimension.
+class blue_noise_sampler: public sobol_sampler{
+  public:
+	std::unique_ptr<sampler> clone()const override{ return std::make_unique<blue_noise_sampler>(*this);}
+  protected:
+	double sample_1d(int d)override{ return shift(sobol_sampler::sample_1d(d),d,0);}
+	point2 sample_2d(int d)override{
+		point2 u=sobol_sampler::sample_2d(d);
+		return point2(shift(u.u,d,0),shift(u.v,d,1));
+	}
+	uint32_t dimension_seed(int d)const override{ return mix_bits(random_seed()^mix_bits(d+1));}
+
+  private:
+	static const int mask_size=64;
+	double shift(double u, int d, int component)const{
+		uint32_t offset=hash(d,component+0x5bd1e995u);
+		int x=(px+int(offset%mask_size))%mask_size,y=(py+int(offset/mask_size%mask_size))%mask_size;
+		u+=mask()[y*mask_size+x];
+		return u<1?u:u-1;
+	}
+	// Dither mask ranked by void-and-cluster (Ulichney 1993): starting from an empty torus, the
+	// pixel with the lowest Gaussian-filtered energy of the pixels placed so far takes the next
+	// rank, so ranks below any threshold are evenly spread.
+	static const std::vector<double>& mask(){
+		static const std::vector<double> values=[]{
+			const int n=mask_size*mask_size;
+			const double sigma=1.5;
+			std::vector<double> kernel(n),energy(n,0),values(n);
+			for(int y=0;y<mask_size;y++)
+				for(int x=0;x<mask_size;x++){
+					int dx=std::min(x,mask_size-x),dy=std::min(y,mask_size-y);
+					kernel[y*mask_size+x]=exp(-(dx*dx+dy*dy)/(2*sigma*sigma));
+				}
+			std::vector<char> placed(n,0);
+			for(int rank=0;rank<n;rank++){
+				int best=-1;
+				for(int i=0;i<n;i++)
+					if(!placed[i]&&(best<0||energy[i]<energy[best]))best=i;
+				placed[best]=1,values[best]=(rank+0.5)/n;
+				int bx=best%mask_size,by=best/mask_size;
+				for(int y=0;y<mask_size;y++)
+					for(int x=0;x<mask_size;x++)
+						energy[y*mask_size+x]+=kernel[(y-by+mask_size)%mask_size*mask_size+(x-bx+mask_size)%mask_size];
+			}
+			return values;
+		}();
+		return values;
+	}
+};
+
+#endif
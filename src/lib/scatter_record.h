@@ -3,16 +3,23 @@
 
 #include "common.h"
 #include "pdf.h"
-#include<functional>
-using std::function;
+
+class material;
 
 class scatter_record{
   public:
-	function<const color(const vec3&)> attenuation;
+	color weight;//direction independent attenuation
+	const material* lobe=nullptr;//set when the attenuation depends on the outgoing direction
+	int lobe_id;
+	double lobe_scale;
+	vec3 normal,view;
 	bool using_importance_sampling;
-	shared_ptr<pdf> sample_pdf;
+	pdf sample_pdf;
 	ray sample_ray;
 	bool path_unchanged=0;
+
+	// Attenuation of a path leaving along dir; defined in material.h.
+	color attenuation(const vec3& dir)const;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -2,7 +2,9 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "material.h"
 #include "common.h"
+#include "orthonormal_basis.h"
 
 class sphere: public hittable{
   public:
@@ -11,55 +13,69 @@ class sphere: public hittable{
 		vec3 vecr(radius,radius,radius);
 		boundingbox=bounding_box(center-vecr,center+vecr);
         area=4*pi*radius*radius;
+        cutout=mat&&mat->alpha_tested();
 	}
 	sphere(const point3& center0, const point3& center1, double radius, shared_ptr<material> mat)
     	:center(ray(center0,center1-center0)), radius(std::max(0.,radius)), mat(mat) {
 		vec3 vecr(radius,radius,radius);
 		boundingbox=bounding_box(bounding_box(center0-vecr,center0+vecr),
 								 bounding_box(center1-vecr,center1+vecr));
+        area=4*pi*radius*radius;
+        cutout=mat&&mat->alpha_tested();
 	}
 
     const void* get_pointer()const override{return this;}
     inline vec3 normAt(const point3& p, double time)const{ return (p-center.at(time))/radius;}
     bool hit(const ray& r, const interval& ray_t, hit_record& rec)const override{
-        vec3 oc=center.at(r.time())-r.origin();
-        double a=r.direction().length_squared();
-        double b=dot(r.direction(),oc);
-        double c=oc.length_squared()-radius*radius;
-
-        double delta=b*b-a*c;
-        if(delta<0)return 0;
-        double sqrtd=std::sqrt(delta);
-        double t=(b-std::sqrt(delta))/a;
-        if(!ray_t.surrounds(t)){
-            t=(b+sqrtd)/a;
-            if(!ray_t.surrounds(t))return 0;
-        }
+        double t;
+        if(!intersect(r,ray_t,t))return 0;
 
         rec.t=t;
-        rec.p=r.at(t);
+        rec.obj=this;
+        return 1;
+    }
+    void compute_surface_interaction(const ray& r, hit_record& rec)const override{
+        rec.p=r.at(rec.t);
 		vec3 outer_norm=normAt(rec.p,r.time());
         rec.set_normal(r,outer_norm);
 		get_sphere_uv(outer_norm,rec.tex_coord);
-        rec.mat=mat;
-        rec.obj=this;
-        return 1;
+        rec.mat=mat.get();
+    }
+    bool occluded(const ray& r, double t_max)const override{
+        double t;
+        return intersect(r,interval(err,t_max),t);
     }
 	bounding_box bbox()const override{ return boundingbox;}
+    // Directions are drawn uniformly inside the cone the sphere subtends from the origin, so none
+    // is spent on the far side. From inside, every direction meets the sphere once.
     double sample_pdf(const ray& r)const override{
-        hit_record rec; ray rt=r;
-        double accum=0;
-        while(hit(rt,interval(err,infty),rec)){
-            double dist_squared=rec.t*rec.t*rt.direction().length_squared();
-            double cos_t=abs(dot(rec.normal,normalize(rt.direction())));
-            accum+=dist_squared/cos_t;
-            rt=ray(rec.p,rt.direction(),rt.time());
-        }
-        return accum/area;
+        vec3 d=center.at(r.time())-r.origin();
+        double dist_squared=d.length_squared();
+        if(dist_squared<=radius*radius)return 1/(4*pi);
+        double sin2_theta_max=radius*radius/dist_squared,cos_theta_max=std::sqrt(1-sin2_theta_max);
+        if(dot(normalize(r.direction()),d)<cos_theta_max*std::sqrt(dist_squared))return 0;
+        return 1/(2*pi*sin2_theta_max/(1+cos_theta_max));
     }
     vec3 sample(const point3& origin, double time=0)const override{
-        point3 P=center.at(time)+radius*random_unit_vector();
-        return normalize(P-origin);
+        vec3 d=center.at(time)-origin;
+        double dist_squared=d.length_squared();
+        if(dist_squared<=radius*radius)return random_unit_vector();
+        double sin2_theta_max=radius*radius/dist_squared,cos_theta_max=std::sqrt(1-sin2_theta_max);
+        double cos_theta=1-random_double()*sin2_theta_max/(1+cos_theta_max),phi=2*pi*random_double();
+        double sin_theta=std::sqrt(std::max(0.,1-cos_theta*cos_theta));
+        return orthonormal_basis::around(d).to_standard(vec3(cos(phi)*sin_theta,sin(phi)*sin_theta,cos_theta));
+    }
+    light_bounds emission_bounds()const override{
+        return light_bounds(boundingbox,pi*area*luminance(mat->mean_emission()));
+    }
+    // Photons leave a uniform point of the surface, outward.
+    bool sample_photon(double time, ray& r, color& power)const override{
+        if(mat->attenuated())return 0;
+        vec3 n=random_unit_vector();
+        point2 uv;
+        get_sphere_uv(n,uv);
+        point3 p=center.at(time)+radius*n;
+        return diffuse_photon(p,n,mat->emission(uv,p),1/area,false,time,r,power);
     }
 
   private:
@@ -68,6 +84,30 @@ class sphere: public hittable{
     std::shared_ptr<material> mat;
 	bounding_box boundingbox;
     double area;
+    bool cutout;//material is alpha tested
+    // Nearest t inside ray_t where r meets the sphere.
+    bool intersect(const ray& r, const interval& ray_t, double& t)const{
+        vec3 oc=center.at(r.time())-r.origin();
+        double a=r.direction().length_squared();
+        double b=dot(r.direction(),oc);
+        double c=oc.length_squared()-radius*radius;
+
+        double delta=b*b-a*c;
+        if(delta<0)return 0;
+        double sqrtd=std::sqrt(delta);
+        t=(b-sqrtd)/a;
+        if(!ray_t.surrounds(t)||!opaque_at(r,t)){
+            t=(b+sqrtd)/a;
+            if(!ray_t.surrounds(t)||!opaque_at(r,t))return 0;
+        }
+        return 1;
+    }
+    bool opaque_at(const ray& r, double t)const{
+        if(!cutout)return 1;
+        point3 p=r.at(t);point2 uv;
+        get_sphere_uv(normAt(p,r.time()),uv);
+        return alpha_test(mat->opacity(uv,p),r,t);
+    }
 	static void get_sphere_uv(const point3& p, point2& tex_coord) {
         tex_coord.v=acos(-p.y())/pi;
         tex_coord.u=atan2(-p.z(),p.x())/(2*pi)+.5;
@@ -79,9 +119,12 @@ class point: public hittable{
     point(const point3& P, shared_ptr<material> mat): P(P), S(make_shared<sphere>(P,1e-3,mat)){}
 
     bool hit(const ray& r, const interval& ray_t, hit_record& rec)const override{return S->hit(r,ray_t,rec);}
+    bool occluded(const ray& r, double t_max)const override{return S->occluded(r,t_max);}
     bounding_box bbox()const override{return S->bbox();}
     double sample_pdf(const ray& r)const override{return S->sample_pdf(r);};
     vec3 sample(const point3& origin, const double time)const override{return S->sample(origin,time);}
+    light_bounds emission_bounds()const override{return S->emission_bounds();}
+    bool sample_photon(double time, ray& r, color& power)const override{return S->sample_photon(time,r,power);}
   private:
     point3 P;
     shared_ptr<sphere> S;
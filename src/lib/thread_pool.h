@@ -0,0 +1,124 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<atomic>
+#include<deque>
+#include<vector>
+#include<memory>
+#include<functional>
+#include<algorithm>
+
+class thread_pool{
+  public:
+	using job=std::function<void(int,int)>;//(task index, worker index)
+
+	thread_pool(int num_threads=0){
+		if(num_threads<=0)num_threads=std::max(1u,std::thread::hardware_concurrency());
+		for(int i=0;i<num_threads;i++)queues.push_back(std::make_unique<work_queue>());
+		for(int i=0;i<num_threads;i++)workers.emplace_back(&thread_pool::worker_loop,this,i);
+	}
+	~thread_pool(){
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping=true;
+		}
+		wake.notify_all();
+		for(auto& worker:workers)worker.join();
+	}
+	thread_pool(const thread_pool&)=delete;
+	thread_pool& operator=(const thread_pool&)=delete;
+
+	int size()const{ return workers.size();}
+
+	// Runs f(task,worker) for every task in [0,num_tasks) and returns once all of them are done.
+	// Each worker is dealt a contiguous range of tasks and takes them from the front; a worker
+	// that runs dry steals from the back of the others, so neighbouring tasks stay on one thread.
+	// Called from inside a task, the loop simply runs inline on the calling worker.
+	void parallel_for(int num_tasks, const job& f){
+		if(num_tasks<=0)return;
+		if(current_worker()>=0){
+			for(int i=0;i<num_tasks;i++)f(i,current_worker());
+			return;
+		}
+		std::lock_guard<std::mutex> batch_lock(batch_mtx);
+		int n=size();
+		remaining=num_tasks;
+		for(int w=0;w<n;w++){
+			std::lock_guard<std::mutex> lock(queues[w]->mtx);
+			queues[w]->f=&f;
+			for(int i=1ll*w*num_tasks/n;i<1ll*(w+1)*num_tasks/n;i++)queues[w]->tasks.push_back(i);
+		}
+		std::unique_lock<std::mutex> lock(mtx);
+		generation++;
+		wake.notify_all();
+		done.wait(lock,[&]{return remaining==0;});
+	}
+
+	static thread_pool& global(){
+		static thread_pool pool;
+		return pool;
+	}
+
+  private:
+	struct work_queue{
+		std::mutex mtx;
+		std::deque<int> tasks;
+		const job* f=nullptr;
+	};
+	std::vector<std::unique_ptr<work_queue> > queues;
+	std::vector<std::thread> workers;
+	std::mutex mtx,batch_mtx;
+	std::condition_variable wake,done;
+	std::atomic<int> remaining{0};
+	long long generation=0;
+	bool stopping=false;
+
+	static int& current_worker(){
+		static thread_local int id=-1;
+		return id;
+	}
+	bool pop(int w, int& task, const job*& f){
+		std::lock_guard<std::mutex> lock(queues[w]->mtx);
+		if(queues[w]->tasks.empty())return 0;
+		task=queues[w]->tasks.front(),f=queues[w]->f;
+		queues[w]->tasks.pop_front();
+		return 1;
+	}
+	bool steal(int w, int& task, const job*& f){
+		int n=size();
+		for(int k=1;k<n;k++){
+			work_queue& victim=*queues[(w+k)%n];
+			std::lock_guard<std::mutex> lock(victim.mtx);
+			if(victim.tasks.empty())continue;
+			task=victim.tasks.back(),f=victim.f;
+			victim.tasks.pop_back();
+			return 1;
+		}
+		return 0;
+	}
+	void worker_loop(int w){
+		current_worker()=w;
+		long long seen=0;
+		while(1){
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				wake.wait(lock,[&]{return stopping||generation!=seen;});
+				if(stopping)return;
+				seen=generation;
+			}
+			int task;const job* f;
+			while(pop(w,task,f)||steal(w,task,f)){
+				(*f)(task,w);
+				if(--remaining==0){
+					std::lock_guard<std::mutex> lock(mtx);
+					done.notify_all();
+				}
+			}
+		}
+	}
+};
+
+#endif
@@ -12,10 +12,15 @@ class translate: public hittable{
 
     bool hit(const ray& r, const interval& ray_t, hit_record& rec)const override{
         ray offset_r(r.origin()-offset,r.direction(),r.time());
-        if(!object->hit(offset_r,ray_t,rec))return 0;
+        //the wrapped object needs the moved ray to finish its record, so it is finished here
+        if(!object->hit_surface(offset_r,ray_t,rec))return 0;
         rec.p+=offset;
+        rec.obj=this;
         return 1;
     }
+    bool occluded(const ray& r, double t_max)const override{
+        return object->occluded(ray(r.origin()-offset,r.direction(),r.time()),t_max);
+    }
     bounding_box bbox()const override{ return boundingbox;}
     double sample_pdf(const ray& r)const override{
         ray offset_r(r.origin()-offset,r.direction(),r.time());
@@ -24,6 +29,16 @@ class translate: public hittable{
     vec3 sample(const point3& origin, const double t)const override{
         return object->sample(origin-offset,t);
     }
+    light_bounds emission_bounds()const override{
+        light_bounds b=object->emission_bounds();
+        b.box=boundingbox;
+        return b;
+    }
+    bool sample_photon(double time, ray& r, color& power)const override{
+        if(!object->sample_photon(time,r,power))return 0;
+        r=ray(r.origin()+offset,r.direction(),r.time());
+        return 1;
+    }
     const void* get_pointer()const override{return this;}
   private:
     shared_ptr<hittable> object;
@@ -45,11 +60,16 @@ class rotate: public hittable{
 
     bool hit(const ray& r, const interval& ray_t, hit_record& rec)const override{
         ray rotated_r(inv_rotation_matrix*(r.origin()-center)+center,inv_rotation_matrix*r.direction(),r.time());
-        if(!object->hit(rotated_r,ray_t,rec))return 0;
+        if(!object->hit_surface(rotated_r,ray_t,rec))return 0;
         rec.p=rotation_matrix*(rec.p-center)+center;
+        rec.obj=this;
         rec.normal=rotation_matrix*rec.normal;
         return 1;
     }
+    bool occluded(const ray& r, double t_max)const override{
+        ray rotated_r(inv_rotation_matrix*(r.origin()-center)+center,inv_rotation_matrix*r.direction(),r.time());
+        return object->occluded(rotated_r,t_max);
+    }
     bounding_box bbox()const override{ return boundingbox;}
     double sample_pdf(const ray& r)const override{
         ray rotated_r(inv_rotation_matrix*(r.origin()-center)+center,inv_rotation_matrix*r.direction(),r.time());
@@ -59,6 +79,17 @@ class rotate: public hittable{
         point3 rotated_origin=inv_rotation_matrix*(origin-center)+center;
         return rotation_matrix*object->sample(rotated_origin,time);
     }
+    light_bounds emission_bounds()const override{
+        light_bounds b=object->emission_bounds();
+        b.box=boundingbox;
+        b.w=rotation_matrix*b.w;
+        return b;
+    }
+    bool sample_photon(double time, ray& r, color& power)const override{
+        if(!object->sample_photon(time,r,power))return 0;
+        r=ray(rotation_matrix*(r.origin()-center)+center,rotation_matrix*r.direction(),r.time());
+        return 1;
+    }
     const void* get_pointer()const override{return this;}
 
   private:
@@ -3,37 +3,81 @@
 
 #include "common.h"
 #include "hittable.h"
+#include "material.h"
+
+// Per-ray part of the watertight ray/triangle test (Woop, Benthin and Wald 2013): the axes are
+// permuted so that z is the dominant direction, and the shear that maps the ray onto +z is kept,
+// so every triangle tested against the ray only needs a translation, a shear and three 2D edge
+// functions. Edges shared by two triangles are evaluated identically from both sides.
+class triangle_ray{
+  public:
+    point3 origin;
+    int kx,ky,kz;
+    double sx,sy,sz;
+    triangle_ray(){}
+    triangle_ray(const ray& r): origin(r.origin()){
+        const vec3& d=r.direction();
+        kz=argmax(std::abs(d.x()),std::abs(d.y()),std::abs(d.z()));
+        kx=(kz+1)%3,ky=(kx+1)%3;
+        if(d[kz]<0)std::swap(kx,ky);
+        sx=d[kx]/d[kz],sy=d[ky]/d[kz],sz=1/d[kz];
+    }
+};
+
+// Returns the hit distance t and the barycentric weights (b1,b2) of B and C, so the hit point
+// is (1-b1-b2)*A+b1*B+b2*C.
+inline bool intersect_triangle(const triangle_ray& r, const point3& A, const point3& B, const point3& C,
+                               const interval& ray_t, double& t, double& b1, double& b2){
+    vec3 a=A-r.origin,b=B-r.origin,c=C-r.origin;
+    double ax=a[r.kx]-r.sx*a[r.kz],ay=a[r.ky]-r.sy*a[r.kz];
+    double bx=b[r.kx]-r.sx*b[r.kz],by=b[r.ky]-r.sy*b[r.kz];
+    double cx=c[r.kx]-r.sx*c[r.kz],cy=c[r.ky]-r.sy*c[r.kz];
+    double u=cx*by-cy*bx,v=ax*cy-ay*cx,w=bx*ay-by*ax;
+    if((u<0||v<0||w<0)&&(u>0||v>0||w>0))return 0;
+    double det=u+v+w;
+    if(det==0)return 0;
+    double T=r.sz*(u*a[r.kz]+v*b[r.kz]+w*c[r.kz]);
+    t=T/det;
+    if(!ray_t.contains(t))return 0;
+    b1=v/det,b2=w/det;
+    return 1;
+}
 
 class triangle: public hittable{
   public:
     triangle(const point3& A, const point3& B, const point3& C, const shared_ptr<material>& mat) 
         :A(A), B(B), C(C), mat(mat){
         vec3 v=cross(B-A,C-A);
-        area=length(v),normal=normalize(v);
+        area=length(v)/2,normal=normalize(v);
         boundingbox=bounding_box(bounding_box(A,B),bounding_box(C,C));
+        cutout=mat&&mat->alpha_tested();
     }
 
     const void* get_pointer()const override{return this;}
     bool hit(const ray& r, const interval& ray_t, hit_record& rec)const override{
-        mat3 M(-r.direction(),B-A,C-A);
-        vec3 b=r.origin()-A;
-        if(abs(det(M))<err)return 0;
-        vec3 v=inv(M)*b;
-        if(v[1]<0||v[2]<0||v[1]+v[2]>1||!ray_t.contains(v[0]))return 0;
-        rec.t=v[0];
+        double t,b1,b2;
+        if(!intersect_triangle(triangle_ray(r),A,B,C,ray_t,t,b1,b2)||!opaque_at(r,t,b1,b2))return 0;
+        rec.t=t;
+        rec.uv=point2(b1,b2);
+        rec.obj=this;
+        return 1;
+    }
+    void compute_surface_interaction(const ray& r, hit_record& rec)const override{
         rec.p=r.at(rec.t);
         rec.set_normal(r,normal);
-        rec.mat=mat;
-        rec.tex_coord=point2(v[1],v[2]);
-        rec.obj=get_pointer();
-        return 1;
+        rec.mat=mat.get();
+        rec.tex_coord=rec.uv;
+    }
+    bool occluded(const ray& r, double t_max)const override{
+        double t,b1,b2;
+        return intersect_triangle(triangle_ray(r),A,B,C,interval(err,t_max),t,b1,b2)&&opaque_at(r,t,b1,b2);
     }
     bounding_box bbox()const override{ return boundingbox;}
     double sample_pdf(const ray& r)const override{
         hit_record rec;
         if(!hit(r,interval(err,infty),rec))return 0;
         double dist_squared=rec.t*rec.t*r.direction().length_squared();
-        double cos_t=abs(dot(rec.normal,normalize(r.direction())));
+        double cos_t=abs(dot(normal,normalize(r.direction())));
         return dist_squared/(cos_t*area);
     }
     vec3 sample(const point3& origin,const double t)const override{
@@ -42,12 +86,26 @@ class triangle: public hittable{
         point3 P=(1-u-v)*A+u*B+v*C;
         return normalize(P-origin);
     }
+    light_bounds emission_bounds()const override{
+        return light_bounds(boundingbox,pi*area*luminance(mat->mean_emission()),normal,1);
+    }
+    bool sample_photon(double time, ray& r, color& power)const override{
+        if(mat->attenuated())return 0;
+        double u=random_double(),v=random_double();
+        if(u+v>1)u=1-u,v=1-v;
+        point3 P=(1-u-v)*A+u*B+v*C;
+        return diffuse_photon(P,normal,mat->emission(point2(u,v),P),1/area,true,time,r,power);
+    }
   private:
     point3 A,B,C;
     vec3 normal;
     shared_ptr<material> mat;
     bounding_box boundingbox;
     double area;
+    bool cutout;//material is alpha tested
+    bool opaque_at(const ray& r, double t, double b1, double b2)const{
+        return !cutout||alpha_test(mat->opacity(point2(b1,b2),r.at(t)),r,t);
+    }
 };
 
 #endif
\ No newline at end of file
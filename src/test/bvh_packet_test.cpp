@@ -0,0 +1,96 @@
+#include "common.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "sphere.h"
+#include "triangle.h"
+
+// Packets traced through a BVH of spheres, loose triangles and a mesh must find the same closest
+// hits as testing every primitive on its own, and occlusion queries the same blockers. Directions
+// include axis-aligned ones, ones with a zero component and ones into the +x+y+z octant, for which
+// the unused slots of a 4-wide node lie on the ray's infinite range.
+int failures=0;
+
+void compare(const hittable& world, const hittable& brute_force, const ray_packet& packet){
+    interval ray_t[ray_packet::max_size];
+    hit_record rec[ray_packet::max_size];
+    for(int i=0;i<packet.size;i++)ray_t[i]=interval(err,infty);
+    int hit_mask=world.hit_packet(packet,packet.all(),ray_t,rec);
+    for(int i=0;i<packet.size;i++){
+        hit_record expected;
+        bool hit=brute_force.hit(packet.rays[i],interval(err,infty),expected);
+        bool packet_hit=hit_mask>>i&1;
+        if(hit!=packet_hit||(hit&&std::abs(rec[i].t-expected.t)>1e-9*std::max(1.,expected.t))){
+            std::clog<<"ray "<<packet.rays[i].origin()<<" -> "<<packet.rays[i].direction()<<": packet "
+                     <<(packet_hit?"t="+std::to_string(rec[i].t):"miss")<<", brute force "
+                     <<(hit?"t="+std::to_string(expected.t):"miss")<<std::endl;
+            failures++;
+        }
+        if(world.occluded(packet.rays[i],infty)!=hit){
+            std::clog<<"ray "<<packet.rays[i].origin()<<" -> "<<packet.rays[i].direction()<<": occluded() says "
+                     <<(hit?"unblocked":"blocked")<<std::endl;
+            failures++;
+        }
+    }
+}
+
+int main(){
+    auto mat=make_shared<lambertian>(color(.5,.5,.5));
+    hittable_list objects,loose;
+    for(int i=0;i<60;i++){
+        point3 center(random_double(-10,10),random_double(-10,10),random_double(-10,10));
+        auto s=make_shared<sphere>(center,random_double(0.2,1.5),mat);
+        objects.add(s),loose.add(s);
+    }
+    for(int i=0;i<60;i++){
+        point3 a(random_double(-10,10),random_double(-10,10),random_double(-10,10));
+        auto t=make_shared<triangle>(a,a+vec3(random_double(-2,2),random_double(-2,2),random_double(-2,2)),
+                                     a+vec3(random_double(-2,2),random_double(-2,2),random_double(-2,2)),mat);
+        objects.add(t),loose.add(t);
+    }
+    //a grid of quads bent into a bowl, once as a mesh and once as loose triangles
+    const int n=12;
+    std::vector<mesh_vertex> vertices;
+    std::vector<vec3i> faces;
+    for(int i=0;i<=n;i++)
+        for(int j=0;j<=n;j++){
+            double x=i-n/2.,z=j-n/2.;
+            vertices.push_back(mesh_vertex(point3(x,0.05*(x*x+z*z)-4,z)));
+        }
+    for(int i=0;i<n;i++)
+        for(int j=0;j<n;j++){
+            int a=i*(n+1)+j,b=a+1,c=a+n+1,d=c+1;
+            faces.push_back(vec3i(a,c,b)),faces.push_back(vec3i(b,c,d));
+        }
+    objects.add(make_shared<mesh>(vertices,faces,mat));
+    for(auto& f:faces)loose.add(make_shared<triangle>(vertices[f.x].position,vertices[f.y].position,vertices[f.z].position,mat));
+    bvh_node world(objects);
+
+    std::vector<vec3> directions;
+    for(int axis=0;axis<3;axis++)
+        for(double sign:{1.,-1.}){
+            vec3 d(0,0,0);
+            d[axis]=sign;
+            directions.push_back(d);
+            vec3 diagonal=d;
+            diagonal[(axis+1)%3]=sign;//zero along the third axis
+            directions.push_back(diagonal);
+        }
+    directions.push_back(vec3(1,1,1));
+    directions.push_back(vec3(0.3,0.5,0.8));
+    for(int k=0;k<8;k++)directions.push_back(random_unit_vector());
+    for(const vec3& d:directions)
+        for(int trial=0;trial<40;trial++){
+            //a coherent packet: nearby origins, a shared direction
+            ray_packet packet;
+            point3 base(random_double(-12,12),random_double(-12,12),random_double(-12,12));
+            while(packet.size<ray_packet::max_size)
+                packet.add(ray(base+vec3(random_double(-1,1),random_double(-1,1),random_double(-1,1)),d));
+            compare(world,loose,packet);
+            //an incoherent one: directions of all kinds from one point
+            packet.clear();
+            for(int k=0;k<ray_packet::max_size;k++)packet.add(ray(base,directions[(k+trial)%directions.size()]));
+            compare(world,loose,packet);
+        }
+    std::clog<<(failures?"FAILED":"passed")<<std::endl;
+    return failures!=0;
+}
@@ -11,13 +11,15 @@
 #include "transformations.h"
 #include "mesh.h"
 #include "loader.h"
+#include "environment.h"
+
+char* ENVMAP_FILE_PATH=nullptr;
 
 void bouncing_spheres(){
-    hittable_list scene, skybox;
+    hittable_list scene;
 
     auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
     scene.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(checker)));
-    skybox.add(make_shared<sphere>(point3(0,0,0),1e6,nullptr));
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
@@ -73,6 +75,8 @@ void bouncing_spheres(){
     cam.defocus_angle = 0.6;
     cam.focus_dist    = 10.0;
 
+    if(ENVMAP_FILE_PATH)cam.environment = make_shared<environment_light>(ENVMAP_FILE_PATH);
+
     cam.render(make_shared<bvh_node>(scene));
 }
 void checkered_spheres() {
@@ -191,6 +195,10 @@ void simple_light() {
     world.add(make_shared<sphere>(point3(0,7,0), 2, difflight));
     world.add(make_shared<quad>(point3(3,1,-2), vec3(2,0,0), vec3(0,2,0), difflight));
 
+    hittable_list lights;
+    lights.add(make_shared<sphere>(point3(0,7,0), 2, difflight));
+    lights.add(make_shared<quad>(point3(3,1,-2), vec3(2,0,0), vec3(0,2,0), difflight));
+
     camera cam;
 
     cam.aspect_ratio      = 16.0 / 9.0;
@@ -206,7 +214,7 @@ void simple_light() {
 
     cam.defocus_angle = 0;
 
-    cam.render(make_shared<hittable_list>(world));
+    cam.render(make_shared<hittable_list>(world),make_shared<hittable_list>(lights));
 }
 void cornell_box() {
     hittable_list world, lights;
@@ -291,7 +299,7 @@ void assimp_test() {
 }
 
 int main(int argc, char **argv) {
-    srand(time(0));
+    seed_random(time(0));
     // Image
     char* OUT_FILE_PATH="output.ppm";
     int demo_id=1;
@@ -306,6 +314,10 @@ int main(int argc, char **argv) {
             if(i==argc-1){std::clog<<"Invalid arguments"<<std::endl;return -1;}
             demo_id=std::stoi(argv[++i]);
         }
+        else if(arg=="-envmap"){
+            if(i==argc-1){std::clog<<"Invalid arguments"<<std::endl;return -1;}
+            ENVMAP_FILE_PATH=argv[++i];
+        }
         else{std::clog<<"Invalid arguments"<<std::endl;return -1;}
     }
     freopen(OUT_FILE_PATH,"w",stdout);
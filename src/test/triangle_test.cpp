@@ -0,0 +1,48 @@
+#include "common.h"
+#include "triangle.h"
+
+// Rays along every axis, and along directions whose other components are zero or tiny, must hit
+// a triangle they cross at the right distance. Directions are shorter than unit length, so no
+// component survives being truncated to an integer.
+int failures=0;
+
+void expect_hit(const point3& A, const point3& B, const point3& C, const ray& r, double expected_t){
+    double t,b1,b2;
+    bool hit=intersect_triangle(triangle_ray(r),A,B,C,interval(err,infty),t,b1,b2);
+    if(!hit||std::abs(t-expected_t)>1e-9){
+        std::clog<<"ray "<<r.origin()<<" -> "<<r.direction()<<": "<<(hit?"t="+std::to_string(t):"miss")
+                 <<", expected t="<<expected_t<<std::endl;
+        failures++;
+    }
+}
+
+int main(){
+    for(int axis=0;axis<3;axis++){
+        //triangle in the plane where coordinate axis is 1, around the axis
+        int u=(axis+1)%3,v=(axis+2)%3;
+        vec3 a(0,0,0),b(0,0,0),c(0,0,0);
+        a[axis]=b[axis]=c[axis]=1;
+        a[u]=-1,a[v]=-1;
+        b[u]=1,b[v]=-1;
+        c[u]=0,c[v]=1;
+        for(double sign:{1.,-1.}){
+            vec3 origin(0,0,0),d(0,0,0);
+            origin[axis]=1-sign*1.25;
+            d[axis]=0.5*sign;
+            expect_hit(a,b,c,ray(origin,d),2.5);
+            for(double tiny:{1e-9,-1e-9}){
+                vec3 skew=d;
+                skew[u]=tiny;
+                expect_hit(a,b,c,ray(origin,skew),2.5);
+            }
+            //diagonal with a zero component, from an offset origin onto the triangle's middle
+            vec3 diagonal=d;
+            diagonal[u]=0.25;
+            point3 shifted=origin;
+            shifted[u]=-0.25*2.5;
+            expect_hit(a,b,c,ray(shifted,diagonal),2.5);
+        }
+    }
+    std::clog<<(failures?"FAILED":"passed")<<std::endl;
+    return failures!=0;
+}